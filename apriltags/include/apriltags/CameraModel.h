@@ -0,0 +1,56 @@
+#ifndef APRILTAGS_CAMERAMODEL_H
+#define APRILTAGS_CAMERAMODEL_H
+
+#include <utility>
+#include <vector>
+
+namespace AprilTags
+{
+
+  //! Pinhole camera with lens distortion, mapping between image and undistorted pixel coordinates
+  /*! Undistorted pixel coordinates are those an ideal pinhole camera with the
+   *  same intrinsics would see: straight lines in the world stay straight in
+   *  them. TagDetector fits the sides of tags in these coordinates and samples
+   *  the image only where it needs a pixel, instead of remapping whole frames.
+   */
+  class CameraModel
+  {
+  public:
+    enum DistortionModel
+    {
+      DISTORTION_NONE,        //!< no distortion, both coordinates are the same
+      DISTORTION_RADTAN,      //!< radial-tangential: k1, k2, p1, p2 and optionally k3, as in OpenCV
+      DISTORTION_EQUIDISTANT, //!< equidistant fisheye: k1, k2, k3, k4, as in cv::fisheye
+    };
+
+    //! No distortion
+    CameraModel();
+
+    //! Constructor
+    /*! @param fx, fy, cx, cy intrinsics in pixels
+     *  @param coefficients distortion coefficients in the order of the model; missing ones are 0
+     */
+    CameraModel(double fx, double fy, double cx, double cy, DistortionModel model,
+                const std::vector<double> &coefficients);
+
+    //! True unless the model is DISTORTION_NONE
+    bool hasDistortion() const { return model != DISTORTION_NONE; }
+
+    //! Undistorted pixel coordinates of an image point (iterative)
+    std::pair<float, float> undistort(const std::pair<float, float> &imagePoint) const;
+
+    //! Image coordinates of an undistorted point (closed form)
+    std::pair<float, float> distort(const std::pair<float, float> &undistortedPoint) const;
+
+    DistortionModel model;
+    double fx, fy, cx, cy;
+    double k[5]; //!< distortion coefficients in the order of the model, unused ones are 0
+
+  private:
+    //! Distorts normalized coordinates; also returns the Jacobian (row-major) if J != 0
+    void distortNormalized(double x, double y, double &xd, double &yd, double *J) const;
+  };
+
+} // namespace
+
+#endif
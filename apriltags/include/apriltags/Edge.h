@@ -46,6 +46,13 @@ namespace AprilTags
      */
     static int edgeCost(float theta0, float theta1, float mag1);
 
+    //! Costs of the four edges leaving pixel (x,y); -1 where there is no edge.
+    /*! The edges lead to the right, downward, diagonally down-right and
+     *  diagonally down-left neighbor, in this order.
+     */
+    static void calcEdgeCosts(float theta0, int x, int y,
+                              const FloatImage &theta, const FloatImage &mag, int costs[4]);
+
     //! Calculates and inserts up to four edges into 'edges', a vector of Edges.
     static void calcEdges(float theta0, int x, int y,
                           const FloatImage &theta, const FloatImage &mag,
@@ -53,6 +60,10 @@ namespace AprilTags
 
     //! Process edges in order of increasing cost, merging clusters if we can do so without exceeding the thetaThresh.
     static void mergeEdges(std::vector<Edge> &edges, UnionFindSimple &uf, float tmin[], float tmax[], float mmin[], float mmax[]);
+
+    //! Same as above, for the first nEdges entries of 'edges'
+    static void mergeEdges(const Edge *edges, size_t nEdges, UnionFindSimple &uf,
+                           float tmin[], float tmax[], float mmin[], float mmax[]);
   };
 
 } // namespace
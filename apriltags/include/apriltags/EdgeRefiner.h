@@ -0,0 +1,57 @@
+#ifndef APRILTAGS_EDGEREFINER_H
+#define APRILTAGS_EDGEREFINER_H
+
+#include <utility>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+#include "CameraModel.h"
+#include "XYWeight.h"
+
+namespace AprilTags
+{
+
+  //! Refines the corners of a quad by refitting its four sides to the image gradient
+  /*! Each side is sampled at regular steps. At every sample the edge is searched
+   *  along the side's normal, within searchRange pixels, as the centroid of the upper half of the
+   *  intensity gradient from dark (inside of the quad) to bright (outside). A
+   *  weighted line fit through these edge points gives the refined side, and the
+   *  refined corners are the intersections of neighbouring sides.
+   *
+   *  With a camera model, corners are given and refined in undistorted pixel
+   *  coordinates (see CameraModel), where the sides are straight; the image is
+   *  sampled at the distorted position of each sample point.
+   */
+  class EdgeRefiner
+  {
+  public:
+    //! Constructor
+    /*! @param searchRange distance in pixels searched for the edge on both sides of each side
+     *  @param camera lens model (not copied, must outlive the refiner), or NULL for image coordinates
+     */
+    explicit EdgeRefiner(float searchRange, const CameraModel *camera = NULL);
+
+    //! Refine the four corners (image coordinates, in order around the quad) on a gray CV_8UC1 image
+    /*! @param samples scratch storage, reused between calls
+     *  @return false if a side could not be refitted; the corners are left unchanged then
+     */
+    bool refine(const cv::Mat &image, std::pair<float, float> corners[4], std::vector<XYWeight> &samples) const;
+
+    //! Same as above, with temporary scratch storage
+    bool refine(const cv::Mat &image, std::pair<float, float> corners[4]) const;
+
+  private:
+    //! Bilinear interpolation of the image at a (possibly undistorted) point, in [0, 255]; false outside of the image
+    bool sample(const cv::Mat &image, float x, float y, float &value) const;
+
+    //! Gradient samples per search along a normal (every 0.25 pixels), bounds searchRange
+    static const int MAX_STEPS = 81;
+
+    float searchRange;
+    const CameraModel *camera;
+  };
+
+} // namespace
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef APRILTAGS_EXECUTOR_H
+#define APRILTAGS_EXECUTOR_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace AprilTags
+{
+
+  //! Worker threads running submitted tasks in submission order
+  /*! Unlike ThreadPool, the submitting thread does not wait: tasks queue up
+   *  until a worker is free, and queued tasks can be cancelled, e.g. to drop
+   *  stale frames when the consumer falls behind.
+   */
+  class Executor
+  {
+  public:
+    typedef std::function<void()> Task;
+    //! Identifies a submitted task; never 0
+    typedef uint64_t TaskId;
+
+    //! Constructor
+    /*! @param numThreads number of worker threads (0 == one per hardware thread) */
+    explicit Executor(unsigned int numThreads);
+
+    //! Cancels the queued tasks and waits for the running ones
+    ~Executor();
+
+    //! Queues task; onCancel (if set) is called instead of task if it is cancelled before it started
+    TaskId submit(const Task &task, const Task &onCancel = Task());
+
+    //! Removes a task from the queue and calls its onCancel
+    /*! @return false if the task already started (or was cancelled before) */
+    bool cancel(TaskId id);
+
+    //! Cancels all queued tasks; returns their number
+    size_t cancelAll();
+
+    //! Number of tasks waiting for a worker
+    size_t numQueued() const;
+
+  private:
+    struct Entry
+    {
+      TaskId id;
+      Task task;
+      Task onCancel;
+    };
+
+    Executor(const Executor &);            //!< don't call
+    Executor &operator=(const Executor &); //!< don't call
+
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::deque<Entry> queue;
+    TaskId nextId;
+    mutable std::mutex mutex;
+    std::condition_variable taskAvailable;
+    bool stopping;
+  };
+
+} // namespace
+
+#endif
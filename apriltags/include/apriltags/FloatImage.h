@@ -14,6 +14,8 @@ namespace DualCoding
 namespace AprilTags
 {
 
+  class ThreadPool;
+
   //! Represent an image as a vector of floats in [0,1]
   class FloatImage
   {
@@ -22,6 +24,11 @@ namespace AprilTags
     int height;
     std::vector<float> pixels;
 
+    //! Horizontal pass of filterFactoredCentered on rows [y0, y1), into r
+    void filterRows(const std::vector<float> &fhoriz, std::vector<float> &r, int y0, int y1) const;
+    //! Vertical pass of filterFactoredCentered on columns [x0, x1), from r
+    void filterColumns(const std::vector<float> &fvert, const std::vector<float> &r, int x0, int x1);
+
   public:
     //! Default constructor
     FloatImage();
@@ -34,6 +41,9 @@ namespace AprilTags
 
     FloatImage &operator=(const FloatImage &other);
 
+    //! Change the dimensions; pixel values are undefined afterwards. Memory is only ever grown.
+    void resize(int widthArg, int heightArg);
+
     float get(int x, int y) const { return pixels[y * width + x]; }
     void set(int x, int y, float v) { pixels[y * width + x] = v; }
 
@@ -42,14 +52,25 @@ namespace AprilTags
     int getNumFloatImagePixels() const { return width * height; }
     const std::vector<float> &getFloatImagePixels() const { return pixels; }
 
-    //! TODO: Fix decimateAvg function. DO NOT USE!
+    //! Halve the resolution, averaging blocks of 2x2 pixels
     void decimateAvg();
 
+    //! Set to source at 1/factor of its resolution, averaging blocks of factor x factor pixels
+    /*! A partial last block row or column is dropped. Rows are decimated in
+     *  parallel if a pool is given. Memory is only ever grown.
+     */
+    void decimateAvg(const FloatImage &source, int factor, ThreadPool *pool = NULL);
+
     //! Rescale all values so that they are between [0,1]
     void normalize();
 
     void filterFactoredCentered(const std::vector<float> &fhoriz, const std::vector<float> &fvert);
 
+    //! Same as above, using 'scratch' as temporary storage instead of allocating it
+    /*! Rows and then columns are filtered in parallel if a pool is given. */
+    void filterFactoredCentered(const std::vector<float> &fhoriz, const std::vector<float> &fvert,
+                                std::vector<float> &scratch, ThreadPool *pool = NULL);
+
     template <typename T>
     void copyToSketch(DualCoding::Sketch<T> &sketch)
     {
@@ -54,6 +54,9 @@ namespace AprilTags
 
     static GLine2D lsqFitXYW(const std::vector<XYWeight> &xyweights);
 
+    //! Same as above, for the n weighted points starting at xyweights
+    static GLine2D lsqFitXYW(const XYWeight *xyweights, size_t n);
+
     inline float getDx() const { return dx; }
     inline float getDy() const { return dy; }
     inline float getFirst() const { return p.first; }
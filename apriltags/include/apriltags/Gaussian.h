@@ -1,6 +1,7 @@
 #ifndef APRILTAGS_GAUSSIAN_H
 #define APRILTAGS_GAUSSIAN_H
 
+#include <atomic>
 #include <cmath>
 #include <vector>
 
@@ -11,7 +12,7 @@ namespace AprilTags
   {
 
   public:
-    static bool warned;
+    static std::atomic<bool> warned;
 
     //! Returns a Gaussian filter of size n.
     /*! @param sigma standard deviation of the Gaussian
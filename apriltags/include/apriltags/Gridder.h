@@ -11,6 +11,9 @@ namespace AprilTags
 {
 
   //! A lookup table in 2D for implementing nearest neighbor.
+  /*! Cells are kept in a pool that is reused by reset(), so a Gridder that
+   *  lives across frames does not allocate once it has grown to size.
+   */
   template <class T>
   class Gridder
   {
@@ -18,61 +21,49 @@ namespace AprilTags
     Gridder(const Gridder &);            //!< don't call
     Gridder &operator=(const Gridder &); //!< don't call
 
+    //! Entry of a cell's singly linked list; 'next' indexes the pool (-1 == end of list)
     struct Cell
     {
       T *object;
-      Cell *next;
+      int next;
 
-      Cell() : object(NULL), next(NULL) {}
-
-      Cell(const Cell &c) : object(c.object), next(c.next) {}
-
-      // Destructor
-      ~Cell()
-      {
-        delete next;
-      }
-
-      Cell &operator=(const Cell &other)
-      {
-        if (this == &other)
-          return *this;
-
-        object = other.object;
-        next = other.next;
-        return *this;
-      }
+      Cell() : object(NULL), next(-1) {}
     };
 
     //! Initializes Gridder constructor
     void gridderInit(float x0Arg, float y0Arg, float x1Arg, float y1Arg, float ppCell)
     {
+      x0 = x0Arg;
+      y0 = y0Arg;
+      pixelsPerCell = ppCell;
       width = (int)((x1Arg - x0Arg) / ppCell + 1);
       height = (int)((y1Arg - y0Arg) / ppCell + 1);
 
       x1 = x0Arg + ppCell * width;
       y1 = y0Arg + ppCell * height;
-      cells = std::vector<std::vector<Cell *>>(height, std::vector<Cell *>(width, (Cell *)NULL));
+      cells.assign(width * height, -1);
+      pool.clear();
     }
 
     float x0, y0, x1, y1;
     int width, height;
     float pixelsPerCell; // pixels per cell
-    std::vector<std::vector<Cell *>> cells;
+    std::vector<int> cells; //!< head of each cell's list (row major), -1 if empty
+    std::vector<Cell> pool;
 
   public:
+    //! Empty gridder, call reset() before use
+    Gridder()
+        : x0(), y0(), x1(), y1(), width(), height(), pixelsPerCell(1), cells(), pool() {}
+
     Gridder(float x0Arg, float y0Arg, float x1Arg, float y1Arg, float ppCell)
         : x0(x0Arg), y0(y0Arg), x1(), y1(), width(), height(), pixelsPerCell(ppCell),
-          cells() { gridderInit(x0Arg, y0Arg, x1Arg, y1Arg, ppCell); }
+          cells(), pool() { gridderInit(x0Arg, y0Arg, x1Arg, y1Arg, ppCell); }
 
-    // Destructor
-    ~Gridder()
+    //! Remove all objects and cover a new area, keeping the allocated memory
+    void reset(float x0Arg, float y0Arg, float x1Arg, float y1Arg, float ppCell)
     {
-      for (unsigned int i = 0; i < cells.size(); i++)
-      {
-        for (unsigned int j = 0; j < cells[i].size(); j++)
-          delete cells[i][j];
-      }
+      gridderInit(x0Arg, y0Arg, x1Arg, y1Arg, ppCell);
     }
 
     void add(float x, float y, T *object)
@@ -82,10 +73,11 @@ namespace AprilTags
 
       if (ix >= 0 && iy >= 0 && ix < width && iy < height)
       {
-        Cell *c = new Cell;
-        c->object = object;
-        c->next = cells[iy][ix];
-        cells[iy][ix] = c;
+        Cell c;
+        c.object = object;
+        c.next = cells[iy * width + ix];
+        cells[iy * width + ix] = (int)pool.size();
+        pool.push_back(c);
         // cout << "Gridder placed seg " << o->getId() << " at (" << ix << "," << iy << ")" << endl;
       }
     }
@@ -97,8 +89,8 @@ namespace AprilTags
     class Iterator
     {
     public:
-      Iterator(Gridder *grid, float x, float y, float range)
-          : outer(grid), ix0(), ix1(), iy0(), iy1(), ix(), iy(), c(NULL) { iteratorInit(x, y, range); }
+      Iterator(const Gridder *grid, float x, float y, float range)
+          : outer(grid), ix0(), ix1(), iy0(), iy1(), ix(), iy(), c(-1) { iteratorInit(x, y, range); }
 
       Iterator(const Iterator &it)
           : outer(it.outer), ix0(it.ix0), ix1(it.ix1), iy0(it.iy0), iy1(it.iy1), ix(it.ix), iy(it.iy), c(it.c) {}
@@ -113,18 +105,19 @@ namespace AprilTags
         ix = it.ix;
         iy = it.iy;
         c = it.c;
+        return *this;
       }
 
       bool hasNext()
       {
-        if (c == NULL)
+        if (c < 0)
           findNext();
-        return (c != NULL);
+        return (c >= 0);
       }
 
       T &next()
       {
-        T *thisObj = c->object;
+        T *thisObj = outer->pool[c].object;
         findNext();
         return *thisObj; // return Segment
       }
@@ -132,9 +125,9 @@ namespace AprilTags
     private:
       void findNext()
       {
-        if (c != NULL)
-          c = c->next;
-        if (c != NULL)
+        if (c >= 0)
+          c = outer->pool[c].next;
+        if (c >= 0)
           return;
 
         ix++;
@@ -148,9 +141,9 @@ namespace AprilTags
           if (iy > iy1)
             break;
 
-          c = outer->cells[iy][ix];
+          c = outer->cells[iy * outer->width + ix];
 
-          if (c != NULL)
+          if (c >= 0)
             break;
           ix++;
         }
@@ -180,17 +173,17 @@ namespace AprilTags
         ix = ix0;
         iy = iy0;
 
-        c = outer->cells[iy][ix];
+        c = outer->cells[iy * outer->width + ix];
       }
 
-      Gridder *outer;
+      const Gridder *outer;
       int ix0, ix1, iy0, iy1;
       int ix, iy;
-      Cell *c;
+      int c;
     };
 
     typedef Iterator iterator;
-    iterator find(float x, float y, float range) { return Iterator(this, x, y, range); }
+    iterator find(float x, float y, float range) const { return Iterator(this, x, y, range); }
   };
 
 } // namespace
@@ -57,10 +57,11 @@ namespace AprilTags
      *  @param path  the segments currently part of the search
      *  @param parent the first segment in the quad
      *  @param depth how deep in the search are we?
+     *  @param maxQuads stop searching once quads holds this many entries (0 == unlimited)
      */
     static void search(const FloatImage &fImage, std::vector<Segment *> &path,
                        Segment &parent, int depth, std::vector<Quad> &quads,
-                       const std::pair<float, float> &opticalCenter);
+                       const std::pair<float, float> &opticalCenter, size_t maxQuads = 0);
 
 #ifdef INTERPOLATE
   private:
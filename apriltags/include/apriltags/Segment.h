@@ -1,6 +1,7 @@
 #ifndef APRILTAGS_SEGMENT_H
 #define APRILTAGS_SEGMENT_H
 
+#include <atomic>
 #include <cmath>
 #include <vector>
 
@@ -50,7 +51,7 @@ namespace AprilTags
     float theta;  // gradient direction (points towards white)
     float length; // length of line segment in pixels
     int segmentId;
-    static int idCounter;
+    static std::atomic<int> idCounter; //!< shared by all threads creating segments
   };
 
 } // namsepace
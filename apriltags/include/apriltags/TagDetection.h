@@ -32,6 +32,9 @@ namespace AprilTags
     //! What was the ID of the detected tag?
     int id;
 
+    //! Index of the family that decoded the tag in TagDetector::tagFamilies (0 with a single family)
+    int family;
+
     //! The hamming distance between the detected code and the true code
     int hammingDistance;
 
@@ -45,6 +48,9 @@ namespace AprilTags
      */
     std::pair<float, float> p[4];
 
+    //! The corners p in undistorted pixel coordinates (see TagDetectorOptions::camera); equal to p without a camera model
+    std::pair<float, float> pUndistorted[4];
+
     //! Center of tag in pixel coordinates.
     std::pair<float, float> cxy;
 
@@ -56,7 +62,8 @@ namespace AprilTags
     /*  Both the input and output coordinates are 2D homogeneous vectors, with y = Hx.
      *  'y' are pixel coordinates, 'x' are tag-relative coordinates. Tag coordinates span
      *  from (-1,-1) to (1,1). The orientation of the homography reflects the orientation
-     *  of the target.
+     *  of the target. With a camera model (TagDetectorOptions::camera), 'y' are
+     *  undistorted pixel coordinates, like pUndistorted.
      */
     Eigen::Matrix3d homography;
 
@@ -1,27 +1,348 @@
 #ifndef APRILTAGS_TAGDETECTOR_H
 #define APRILTAGS_TAGDETECTOR_H
 
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include "opencv2/opencv.hpp"
 
+#include "CameraModel.h"
 #include "TagDetection.h"
 #include "TagFamily.h"
 #include "FloatImage.h"
+#include "Executor.h"
+#include "TagDetectorWorkspace.h"
 
 namespace AprilTags
 {
 
+	class ThreadPool;
+
+	//! Detects the tags of one family in grayscale images
+	/*! All extractTags overloads are const and may be called from several
+	 *  threads at once. The tag family, the options and the filter kernels are
+	 *  set up by the constructor and only read afterwards. Everything a call
+	 *  writes lives in a TagDetectorWorkspace: either the one given by the
+	 *  caller or one borrowed from a pool kept by the detector, which grows to
+	 *  the number of concurrent calls. One detector can thus serve a pool of
+	 *  worker threads without a copy per thread.
+	 */
 	class TagDetector
 	{
 	public:
+		typedef std::chrono::steady_clock Clock;
+
+		//! Limits bounding the worst-case cost of a single extractTags call (0 == unlimited)
+		struct TagDetectorOptions
+		{
+			TagDetectorOptions() : maxClusters(0),
+								   maxChildrenPerSegment(0),
+								   maxQuads(0),
+								   numThreads(1),
+								   tileSize(0),
+								   maxTagSize(200),
+								   threadPool(),
+								   asyncThreads(1),
+								   decimate(1),
+								   camera(){};
+			//! Keep at most this many clusters (the largest ones) for line fitting
+			size_t maxClusters;
+			//! Keep at most this many successors per segment (the best fitting ones)
+			size_t maxChildrenPerSegment;
+			//! Stop the quad search once this many quads were found (longest segments are searched first)
+			size_t maxQuads;
+			//! Threads working on each extractTags call, including the caller (0 == one per core)
+			/*! All stages except merging edges into clusters run in parallel. Detections
+			 *  are identical for any number of threads.
+			 */
+			unsigned int numThreads;
+			//! Process full frames in overlapping square tiles of this size in pixels (0 == no tiling)
+			/*! Tiles run in parallel, each one through the whole pipeline, and Step nine
+			 *  merges the tags found twice in the overlaps. Small tiles keep the
+			 *  intermediates of a tile in cache, see tileSizeForCache().
+			 */
+			int tileSize;
+			//! Largest tag (extent in pixels) that tiling must not lose; sets the tile overlap
+			int maxTagSize;
+			//! Pool to run on instead of one of numThreads threads owned by the detector
+			/*! Detectors sharing a pool, e.g. one per camera of a rig, help each other
+			 *  with their parallel stages when they run concurrently.
+			 */
+			std::shared_ptr<ThreadPool> threadPool;
+			//! Asynchronous extractTags calls running at once (0 == one per core)
+			/*! Each call additionally uses the numThreads threads of the pool. */
+			unsigned int asyncThreads;
+			//! Find quads on the image downsampled by this factor, e.g. 2 or 4 (1 == full resolution)
+			/*! Steps two to seven run on the box-averaged image, which cuts their cost
+			 *  by about decimate^2. The quads are then mapped back, their corners are
+			 *  refined on the full-resolution image (see EdgeRefiner) and they are
+			 *  decoded at full resolution. Tags need edges of at least
+			 *  decimate * Quad::minimumEdgeLength pixels.
+			 */
+			int decimate;
+			//! Lens model of the camera; detect on distorted images without remapping them
+			/*! The edge pixels are undistorted before Step five fits lines to them, so
+			 *  quads are found and decoded in undistorted pixel coordinates, where the
+			 *  sides of tags are straight. Only the pixels read to decode a quad are
+			 *  mapped back to the image. Detections report corners in both coordinates
+			 *  (TagDetection::p and pUndistorted).
+			 */
+			CameraModel camera;
+		};
+
+		//! Diagnostics of a single extractTags call
+		struct ExtractionStatus
+		{
+			ExtractionStatus() : numClusters(0), numSegments(0), numQuads(0), numDetections(0),
+								 clustersCapped(false), childrenCapped(false), quadsCapped(false),
+								 partial(false){};
+			size_t numClusters;	  //!< clusters found (before maxClusters is applied)
+			size_t numSegments;	  //!< line segments fitted to the kept clusters
+			size_t numQuads;	  //!< quads passed on to decoding
+			size_t numDetections; //!< unique tags returned
+
+			bool clustersCapped; //!< the smallest clusters were dropped due to maxClusters
+			bool childrenCapped; //!< segment successors were pruned due to maxChildrenPerSegment
+			bool quadsCapped;	 //!< the quad search was stopped early due to maxQuads
+
+			//! True if any cap triggered, i.e. tags may have been missed in favour of latency
+			bool capped() const { return clustersCapped || childrenCapped || quadsCapped; }
+
+			//! The deadline expired; only the tags decoded until then were returned
+			bool partial;
+
+			//! Add the counts and flags of a part of the image processed separately
+			void add(const ExtractionStatus &other)
+			{
+				numClusters += other.numClusters;
+				numSegments += other.numSegments;
+				numQuads += other.numQuads;
+				numDetections += other.numDetections;
+				clustersCapped |= other.clustersCapped;
+				childrenCapped |= other.childrenCapped;
+				quadsCapped |= other.quadsCapped;
+				partial |= other.partial;
+			}
+		};
+
 		const TagFamily thisTagFamily;
+		//! All families decoded, in order of priority; the first one is thisTagFamily
+		const std::vector<TagFamily> tagFamilies;
+		const TagDetectorOptions options;
 
 		//! Constructor
 		// note: TagFamily is instantiated here from TagCodes
-		TagDetector(const TagCodes &tagCodes, const size_t blackBorder = 2) : thisTagFamily(tagCodes, blackBorder) {}
+		TagDetector(const TagCodes &tagCodes, const size_t blackBorder = 2,
+					const TagDetectorOptions &options = TagDetectorOptions());
+
+		//! Constructor for several tag families sharing Steps one to seven
+		/*! Every quad is sampled at the bit lattice of each family in turn and decoded
+		 *  against its codes; the first family that decodes it wins (see
+		 *  TagDetection::family). An extra family thus only costs decoding time.
+		 *  @param families at least one
+		 */
+		explicit TagDetector(const std::vector<TagFamily> &families,
+							 const TagDetectorOptions &options = TagDetectorOptions());
+
+		//! Copies the configuration and shares the thread pool; the copy starts without idle workspaces
+		//! and creates its own executor
+		TagDetector(const TagDetector &other);
+
+		std::vector<TagDetection> extractTags(const cv::Mat &image) const;
+
+		//! Same as above, additionally reporting stage sizes and triggered caps in 'status'
+		/*! The deadline is checked between stages and inside the quad search and
+		 *  decoding loops. Once it has expired, the tags decoded so far are returned
+		 *  and status.partial is set.
+		 */
+		std::vector<TagDetection> extractTags(const cv::Mat &image, ExtractionStatus &status,
+											  const Clock::time_point &deadline = Clock::time_point::max()) const;
+
+		//! Called with each tag as soon as it is decoded, see the extractTags overload taking it
+		typedef std::function<void(const TagDetection &detection)> TagCallback;
+
+		//! Same as above, additionally calling onTag with every tag as soon as it is decoded
+		/*! Lowers the time to the first tag for consumers that can start on single
+		 *  tags. The calls come from the threads of the pool, one at a time; keep
+		 *  them short, since decoding waits for them. A tag decoded again (e.g. in
+		 *  the overlap of tiles) is only reported again if it beats the earlier one
+		 *  by the rules of Step nine; the later call for the same id supersedes the
+		 *  earlier one. The returned detections are authoritative.
+		 */
+		std::vector<TagDetection> extractTags(const cv::Mat &image, ExtractionStatus &status, const TagCallback &onTag,
+											  const Clock::time_point &deadline = Clock::time_point::max()) const;
+
+		//! Same as extractTags(image, status, deadline), using the caller's workspace instead of one from the detector's pool
+		/*! Useful for threads that own their scratch memory; the workspace must
+		 *  not be used by another call at the same time.
+		 */
+		std::vector<TagDetection> extractTags(const cv::Mat &image, TagDetectorWorkspace &workspace,
+											  ExtractionStatus &status,
+											  const Clock::time_point &deadline = Clock::time_point::max()) const;
+
+		//! Extract tags only inside the given regions of interest (in image coordinates)
+		/*! Each region is grown by roiMargin pixels and processed on its own, so the cost
+		 *  scales with the ROI area. Tags lying inside a region are detected as in a
+		 *  full-frame run. Caps of TagDetectorOptions apply per region.
+		 */
+		std::vector<TagDetection> extractTags(const cv::Mat &image, const std::vector<cv::Rect> &rois,
+											  ExtractionStatus &status,
+											  const Clock::time_point &deadline = Clock::time_point::max()) const;
+
+		//! Extract tags only where the binary mask (CV_8UC1, image size) is non-zero
+		/*! Each connected region of the mask is processed in the (grown) window of its
+		 *  bounding box; pixels outside of the mask do not contribute gradients, edges
+		 *  or clusters.
+		 */
+		std::vector<TagDetection> extractTags(const cv::Mat &image, const cv::Mat &mask,
+											  ExtractionStatus &status,
+											  const Clock::time_point &deadline = Clock::time_point::max()) const;
+
+		//! Verify a tag at a predicted quad, e.g. one the others predict but extractTags missed
+		/*! The sides of the quad are first refitted to the image with EdgeRefiner within
+		 *  searchRange pixels (0 == decode the corners as given), then the bits are read as
+		 *  in Step eight. Only a window around the quad is read, so this costs about as much
+		 *  as decoding a single quad of extractTags.
+		 *  @param corners coordinates of TagDetection::pUndistorted (image coordinates without a
+		 *  camera model), in its cyclic order (any rotation)
+		 *  @return true if a good tag was decoded into detection
+		 */
+		bool decodeAt(const cv::Mat &image, const std::pair<float, float> corners[4], float searchRange,
+					  TagDetection &detection) const;
+
+		//! Called with the result of an asynchronous extractTags call, on a thread of the executor
+		typedef std::function<void(std::vector<TagDetection> &detections, const ExtractionStatus &status)>
+			DetectionsCallback;
+
+		//! Queue extractTags on the executor of the detector and return at once
+		/*! The image is not copied (cv::Mat shares its buffer). If the call is
+		 *  cancelled through executor() before it started, get() on the future
+		 *  throws std::future_error (broken_promise). The detector must outlive
+		 *  the call.
+		 *  @param outTaskId if not NULL, receives the id to cancel the call with
+		 */
+		std::future<std::vector<TagDetection>> extractTagsAsync(const cv::Mat &image,
+																Executor::TaskId *outTaskId = NULL) const;
+
+		//! Same as above, calling onComplete with the detections instead of fulfilling a future
+		/*! onCancelled (if set) is called instead if the call is cancelled before it started. */
+		Executor::TaskId extractTagsAsync(const cv::Mat &image, const DetectionsCallback &onComplete,
+										  const Executor::Task &onCancelled = Executor::Task()) const;
+
+		//! Runs the parallel stages of extractTags; may be used for other per-frame work as well
+		ThreadPool &pool() const { return *threadPool; }
+
+		//! Runs the asynchronous calls; created with asyncThreads threads on first use
+		/*! Cancel queued calls here, e.g. to drop stale frames. */
+		Executor &executor() const;
+
+		//! Step nine: of overlapping detections with the same id keep the best one
+		/*! Detections with lower hamming distance win, then those with greater observed perimeter. */
+		static void mergeDetections(const std::vector<TagDetection> &detections,
+									std::vector<TagDetection> &goodDetections);
+
+		//! Pixels added around each region of interest; covers the filter and gradient support
+		static const int roiMargin = 4;
+
+		//! Approximate size of the intermediates of extractTags per pixel of the image
+		static const int bytesPerPixel = 96;
+
+		//! Largest tile size whose intermediates fit into cacheBytes (e.g. the L2 cache size)
+		/*! The result is never smaller than twice the overlap needed for maxTagSize,
+		 *  since smaller tiles would mostly process their overlaps.
+		 */
+		static int tileSizeForCache(size_t cacheBytes, int maxTagSize);
+
+	private:
+		TagDetector &operator=(const TagDetector &); //!< don't call
+
+		//! Gaussian smoothing kernel applied to image (0 == no filter).
+		/*! Used when sampling bits. Filtering is a good idea in cases
+		 * where A) a cheap camera is introducing artifical sharpening, B)
+		 * the bayer pattern is creating artifcats, C) the sensor is very
+		 * noisy and/or has hot/cold pixels. However, filtering makes it
+		 * harder to decode very small tags. Reasonable values are 0, or
+		 * [0.8, 1.5].
+		 */
+		const float sigma;
+
+		//! Gaussian smoothing kernel applied to image (0 == no filter).
+		/*! Used when detecting the outline of the box. It is almost always
+		 * useful to have some filtering, since the loss of small details
+		 * won't hurt. Recommended value = 0.8. The case where sigma ==
+		 * segsigma has been optimized to avoid a redundant filter
+		 * operation.
+		 */
+		const float segSigma;
+
+		//! Filter kernels of sigma and segSigma (empty if the filter is disabled)
+		const std::vector<float> filter;
+		const std::vector<float> segFilter;
+
+		//! Runs the parallel parts of every stage; shared by concurrent extractTags calls
+		std::shared_ptr<ThreadPool> threadPool;
+
+		//! Workspaces not in use by any extractTags call
+		mutable std::vector<std::unique_ptr<TagDetectorWorkspace>> idleWorkspaces;
+		mutable std::mutex workspaceMutex;
+
+		//! Take an idle workspace from the pool, or create one if all are in use
+		TagDetectorWorkspace *acquireWorkspace() const;
+		//! Put a workspace taken by acquireWorkspace back into the pool
+		void releaseWorkspace(TagDetectorWorkspace *ws) const;
+
+		//! Borrows a workspace from the pool for the lifetime of the lease
+		class WorkspaceLease
+		{
+		public:
+			explicit WorkspaceLease(const TagDetector &detector)
+				: detector(detector), ws(detector.acquireWorkspace()) {}
+			~WorkspaceLease() { detector.releaseWorkspace(ws); }
+			TagDetectorWorkspace &workspace() { return *ws; }
+
+		private:
+			WorkspaceLease(const WorkspaceLease &);			   //!< don't call
+			WorkspaceLease &operator=(const WorkspaceLease &); //!< don't call
+			const TagDetector &detector;
+			TagDetectorWorkspace *ws;
+		};
+
+		//! Overlap between neighbouring tiles, so that every tag up to maxTagSize lies inside a tile
+		int tileOverlap() const { return options.maxTagSize + 2 * roiMargin; }
+
+		//! Split the image into overlapping tiles; false if tiling is off or the image fits into one tile
+		bool tileWindows(const cv::Mat &image, std::vector<cv::Rect> &tiles) const;
+
+		//! Steps one to eight on each tile; in parallel with pooled workspaces if ws is NULL
+		void detectInTiles(const cv::Mat &image, const std::vector<cv::Rect> &tiles, TagDetectorWorkspace *ws,
+						   ExtractionStatus &status, const Clock::time_point &deadline, const TagCallback &onTag,
+						   std::vector<TagDetection> &detections) const;
+
+		//! Turn regions of interest into clipped processing windows, merging overlapping ones
+		static void roiWindows(const cv::Mat &image, const std::vector<cv::Rect> &rois, std::vector<cv::Rect> &windows);
+
+		//! Steps one to eight on a window of the image; appends detections in image coordinates
+		/*! onTag (if set) is called with every decoded tag, possibly from several threads at once. */
+		void detectInWindow(const cv::Mat &image, const cv::Rect &window, const cv::Mat &mask,
+							TagDetectorWorkspace &ws, ExtractionStatus &status, const Clock::time_point &deadline,
+							const TagCallback &onTag, std::vector<TagDetection> &detections) const;
+
+		//! Step eight for one quad: read its bits from fim (which covers window); true if a tag was decoded
+		bool decodeQuad(Quad &quad, const FloatImage &fim, const cv::Rect &window, TagDetection &detection) const;
+
+		//! Read the bits of quad at the lattice of family; false if a bit lies outside of window
+		/*! The quad is in undistorted coordinates of camera, each bit is read at its image position. */
+		static bool readCode(Quad &quad, const TagFamily &family, const CameraModel &camera, const FloatImage &fim,
+							 const cv::Rect &window, unsigned long long &tagCode);
 
-		std::vector<TagDetection> extractTags(const cv::Mat &image);
+		//! Created by executor() on first use; declared last, so that its destructor waits for
+		//! running asynchronous calls while the rest of the detector is still intact
+		mutable std::unique_ptr<Executor> asyncExecutor;
+		mutable std::mutex executorMutex;
 	};
 
 } // namespace
@@ -0,0 +1,72 @@
+#ifndef APRILTAGS_TAGDETECTORWORKSPACE_H
+#define APRILTAGS_TAGDETECTORWORKSPACE_H
+
+#include <utility>
+#include <vector>
+
+#include "Edge.h"
+#include "FloatImage.h"
+#include "Gridder.h"
+#include "Quad.h"
+#include "Segment.h"
+#include "TagDetection.h"
+#include "UnionFindSimple.h"
+#include "XYWeight.h"
+
+namespace AprilTags
+{
+
+  //! Intermediate buffers of TagDetector, kept alive between frames.
+  /*! All buffers grow to the largest window processed so far and are
+   *  reused afterwards, so that detection on a stream of equally sized
+   *  frames does no large heap allocations once the first frame is done.
+   *  A workspace must not be used by two extractTags calls at the same time.
+   */
+  class TagDetectorWorkspace
+  {
+  public:
+    TagDetectorWorkspace() : uf(0) {}
+
+    //! Buffers are never shared: a copy starts out empty
+    TagDetectorWorkspace(const TagDetectorWorkspace &) : uf(0) {}
+    TagDetectorWorkspace &operator=(const TagDetectorWorkspace &) { return *this; }
+
+    // Steps one and two: input image, filtered images and gradients
+    FloatImage fimOrig;
+    FloatImage fimDecimated; //!< fimOrig box-averaged, see TagDetectorOptions::decimate
+    FloatImage fim;
+    FloatImage fimSeg;
+    FloatImage fimTheta;
+    FloatImage fimMag;
+    std::vector<float> filterScratch; //!< temporary of FloatImage::filterFactoredCentered
+
+    // Step three: edges sorted by cost and the clusters they merge
+    std::vector<signed char> edgeCosts; //!< four costs per pixel, see Edge::calcEdgeCosts
+    std::vector<size_t> costHistogram;  //!< per band of rows: start of each cost in 'edges'
+    std::vector<Edge> edges;
+    std::vector<float> storage; //!< tmin, tmax, mmin and mmax of Edge::mergeEdges
+    UnionFindSimple uf;
+
+    // Step four: clusters ordered by representative, with their points stored back to back
+    std::vector<int> pixelReps;                     //!< per pixel, -1 if its set is too small
+    std::vector<int> clusterIndex;                  //!< per representative pixel, -1 if no cluster
+    std::vector<std::pair<int, int>> clusters;      //!< (representative, number of points)
+    std::vector<std::pair<int, int>> clustersBySize; //!< (-number of points, representative), for maxClusters
+    std::vector<size_t> clusterOffsets;
+    std::vector<XYWeight> clusterPoints;
+    std::vector<XYWeight> clusterPointsUndistorted; //!< clusterPoints with a camera model, see TagDetectorOptions::camera
+
+    // Steps five to eight
+    std::vector<Segment> segments;
+    std::vector<char> segmentFitted; //!< per cluster, whether a segment was fitted
+    Gridder<Segment> gridder;
+    std::vector<std::pair<float, unsigned int>> searchOrder;
+    std::vector<std::vector<Quad>> chunkQuads; //!< quads found by each chunk of the parallel search
+    std::vector<Quad> quads;
+    std::vector<TagDetection> decoded;
+    std::vector<char> decodedGood;
+  };
+
+} // namespace
+
+#endif
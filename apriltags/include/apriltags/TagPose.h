@@ -0,0 +1,57 @@
+#ifndef APRILTAGS_TAGPOSE_H
+#define APRILTAGS_TAGPOSE_H
+
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "TagDetection.h"
+
+namespace AprilTags
+{
+
+  //! The two poses of a square tag that explain its corners, see estimateTagPoses
+  /*! A small or distant planar tag seen almost head-on is ambiguous: a second
+   *  pose, mirrored about the line of sight, fits the corners nearly as well.
+   *  Both are kept so that the caller can decide, e.g. from other tags or the
+   *  previous frame.
+   */
+  struct TagPose
+  {
+    TagPose();
+
+    //! Rotation tag to camera, camera frame as in TagDetection::getRelativeTransform (z forward, x right, y down)
+    Eigen::Matrix3d R[2];
+
+    //! Position of the tag centre in the camera frame, in the unit of the tag size
+    Eigen::Vector3d t[2];
+
+    //! RMS reprojection error of the four corners in pixels; error[0] <= error[1]
+    double error[2];
+
+    //! False if the tag is degenerate (e.g. seen edge-on); the poses are undefined then
+    bool good;
+  };
+
+  //! Pose of one tag by IPPE (Collins and Bartoli, Infinitesimal Plane-based Pose Estimation, 2014)
+  /*! The rotations follow in closed form from the tag homography and its
+   *  derivative at the tag centre, the translations from a linear fit to the
+   *  four corners. Fixed-size matrices only, no heap allocations.
+   *  With a camera model (TagDetectorOptions::camera) the homography and
+   *  TagDetection::pUndistorted are in undistorted coordinates, which fit the
+   *  pinhole intrinsics given here.
+   *  @param tagSize side length of the black square
+   *  @param fx, fy, px, py intrinsics in pixels
+   *  @return pose.good
+   */
+  bool estimateTagPose(const TagDetection &detection, double tagSize, double fx, double fy, double px, double py,
+                       TagPose &pose);
+
+  //! estimateTagPose for each detection; outPoses[i] is the pose of detections[i]
+  /*! Allocates only if outPoses grows, so reusing it across frames costs no allocations. */
+  void estimateTagPoses(const std::vector<TagDetection> &detections, double tagSize, double fx, double fy,
+                        double px, double py, std::vector<TagPose> &outPoses);
+
+} // namespace
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef APRILTAGS_THREADPOOL_H
+#define APRILTAGS_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace AprilTags
+{
+
+  //! A fixed set of worker threads running the chunks of parallel loops.
+  /*! The thread calling parallelFor works on its own loop as well, so nested
+   *  loops and loops of concurrent callers sharing a pool always make progress.
+   *  With a single thread everything runs on the caller, in order.
+   */
+  class ThreadPool
+  {
+  public:
+    //! Loop body, called for the iterations [begin, end)
+    typedef std::function<void(int begin, int end)> Body;
+
+    //! Constructor
+    /*! @param numThreads number of threads working on a loop, including the
+     *  calling thread (0 == one per hardware thread)
+     */
+    explicit ThreadPool(unsigned int numThreads);
+
+    ~ThreadPool();
+
+    //! Number of threads working on a loop, including the calling thread
+    unsigned int size() const { return (unsigned int)workers.size() + 1; }
+
+    //! Runs body on chunks of chunkSize iterations of [0, n) and returns once all are done
+    /*! Chunks are formed in order, i.e. chunk k covers [k * chunkSize, (k+1) * chunkSize).
+     *  An exception thrown by the body is rethrown here after all chunks finished.
+     */
+    void parallelFor(int n, int chunkSize, const Body &body);
+
+    //! Chunk size splitting n iterations into about chunksPerThread chunks per thread
+    int chunkSize(int n, int chunksPerThread = 4) const;
+
+  private:
+    struct Job;
+
+    ThreadPool(const ThreadPool &);            //!< don't call
+    ThreadPool &operator=(const ThreadPool &); //!< don't call
+
+    void workerLoop();
+
+    //! Runs the next chunk of job; false if no chunk was left
+    static bool runChunk(Job &job);
+
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<Job>> jobs; //!< loops that may still have chunks to hand out
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    bool stopping;
+  };
+
+} // namespace
+
+#endif
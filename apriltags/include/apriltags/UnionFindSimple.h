@@ -22,10 +22,23 @@ namespace AprilTags
       init();
     };
 
+    //! Start over with maxId singleton sets, reusing the allocated memory
+    void reset(int maxId)
+    {
+      data.resize(maxId);
+      init();
+    }
+
     int getSetSize(int thisId) { return data[getRepresentative(thisId)].size; }
 
     int getRepresentative(int thisId);
 
+    //! Same as getRepresentative, but without shortening the path; safe to call from several threads
+    int findRepresentative(int thisId) const;
+
+    //! Size of the set of a representative returned by findRepresentative
+    int getRepresentativeSetSize(int repId) const { return data[repId].size; }
+
     //! Returns the id of the merged node.
     /*  @param aId
      *  @param bId
@@ -1,6 +1,8 @@
 #ifndef APRILTAGS_GRIDDETECTOR_HPP
 #define APRILTAGS_GRIDDETECTOR_HPP
 
+#include <functional>
+#include <future>
 #include <vector>
 #include <Eigen/Core>
 #include <opencv2/core/core.hpp>
@@ -11,7 +13,7 @@ namespace calibration_toolkit
 {
 
   /**
-   * @brief Detection of an aprilgrid
+   * @brief Detection of an aprilgrid, by default of 6 x 6 tags with ids 0 to 35
    * point ordering: (e.g. 2x2 grid)
    *        12-----13  14-----15
    *        | TAG 3 |  | TAG 4 |
@@ -20,30 +22,277 @@ namespace calibration_toolkit
    *  y     | TAG 1 |  | TAG 2 |
    * ^      0-------1  2-------3
    * |-->x
+   *
+   * Thread safety: the const methods (computeObservation in particular) may be
+   * called concurrently, so one detector can serve several worker threads. The
+   * tag detector keeps a pool of scratch buffers that grows to the number of
+   * concurrent calls. This does not hold with showExtractionVideo enabled or when
+   * duplicate tags are found, since both use the (single threaded) OpenCV GUI.
    */
 
   class AprilgridDetector
   {
   public:
+    /// \brief matrix type of the target points, one point (x, y, z) per row
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> PointMatrix;
+
+    /// \brief what computeObservation does when a tag id is detected more than once
+    enum DuplicateTagPolicy
+    {
+      DUPLICATES_SHOW_AND_EXIT, ///< show the duplicates in a window, wait for a key and exit the process
+      DUPLICATES_REJECT_FRAME,  ///< return OBSERVATION_DUPLICATE_TAGS and no corners
+      DUPLICATES_DROP,          ///< remove all tags of a duplicated id, use the remaining ones
+      DUPLICATES_KEEP_BEST      ///< keep the tag with the lowest hamming distance, then the largest perimeter
+    };
+
+    /// \brief how computeObservation refines the tag corners (if doSubpixRefinement is set)
+    enum CornerRefinement
+    {
+      CORNER_REFINEMENT_SUBPIX, ///< cv::cornerSubPix on each corner
+      CORNER_REFINEMENT_EDGES   ///< refit the four sides of each tag to the image gradient, see AprilTags::EdgeRefiner
+    };
+
+    /// \brief outcome of computeObservation
+    enum ObservationResult
+    {
+      OBSERVATION_OK,
+      OBSERVATION_TOO_FEW_TAGS,  ///< less than minTagsForValidObs usable tags
+      OBSERVATION_DUPLICATE_TAGS ///< duplicate tag ids with DUPLICATES_REJECT_FRAME
+    };
+
+    /// \brief diagnostics of one computeObservation call
+    struct ObservationStatus
+    {
+      ObservationStatus() : result(OBSERVATION_OK),
+                            numTagsDetected(0),
+                            numTagsNearBorder(0),
+                            numTagsBad(0),
+                            numTagsOutOfRange(0),
+                            numDuplicateIds(0),
+                            numTagsDuplicate(0),
+                            numTagsRecovered(0),
+                            numTagsUsed(0),
+                            numCornersObserved(0),
+                            numCornersSubpixRejected(0){};
+      ObservationResult result;
+      /// stage sizes, triggered caps and deadline of the tag detector
+      AprilTags::TagDetector::ExtractionStatus extraction;
+      size_t numTagsDetected;   ///< tags returned by the tag detector
+      size_t numTagsNearBorder; ///< removed: a corner closer than minBorderDistance to the image border
+      size_t numTagsBad;        ///< removed: flagged as not good by the tag detector
+      size_t numTagsOutOfRange; ///< removed: id does not belong to this grid
+      size_t numDuplicateIds;   ///< ids detected more than once
+      size_t numTagsDuplicate;  ///< removed by the duplicate tag policy
+      size_t numTagsRecovered;  ///< added by recoverMissingTags
+      size_t numTagsUsed;       ///< tags left for the observation
+      size_t numCornersObserved;
+      size_t numCornersSubpixRejected; ///< corners moved further than maxSubpixDisplacement2 by refinement
+    };
+
     struct AprilgridOptions
     {
       AprilgridOptions() : doSubpixRefinement(true),
+                           cornerRefinement(CORNER_REFINEMENT_SUBPIX),
                            maxSubpixDisplacement2(1.5),
                            showExtractionVideo(false),
                            minTagsForValidObs(4),
                            minBorderDistance(5.0),
-                           blackTagBorder(2){};
+                           blackTagBorder(2),
+                           maxClusters(0),
+                           maxChildrenPerSegment(0),
+                           maxQuads(0),
+                           numThreads(1),
+                           tileSize(0),
+                           maxTagSize(200),
+                           duplicateTagPolicy(DUPLICATES_SHOW_AND_EXIT),
+                           batchThreads(0),
+                           threadPool(),
+                           asyncThreads(1),
+                           decimate(1),
+                           trackingFullFrameInterval(30),
+                           trackingMargin(8.0),
+                           trackingMotionScale(1.5),
+                           flowKeyframeInterval(30),
+                           flowWindowSize(21),
+                           flowPyramidLevels(3),
+                           flowMaxResidual(1.0),
+                           flowMaxLostFraction(0.1),
+                           recoverMissingTags(false),
+                           recoverySearchRange(3.0),
+                           camera(){};
       bool doSubpixRefinement;
+      /// CORNER_REFINEMENT_EDGES runs in parallel over the tags and degrades less on blur; it searches the
+      /// edges within sqrt(maxSubpixDisplacement2) + 1 pixels
+      CornerRefinement cornerRefinement;
       double maxSubpixDisplacement2;
       bool showExtractionVideo;
       unsigned int minTagsForValidObs;
       double minBorderDistance;
       unsigned int blackTagBorder;
+      /// per-stage caps of the tag detector bounding the worst-case latency (0 == unlimited),
+      /// see AprilTags::TagDetector::TagDetectorOptions
+      size_t maxClusters;
+      size_t maxChildrenPerSegment;
+      size_t maxQuads;
+      /// threads the tag detector uses per image, including the calling thread (0 == one per core)
+      unsigned int numThreads;
+      /// split large images into overlapping tiles of this size [px] (0 == no tiling); tiles overlap
+      /// by the largest tag size maxTagSize [px], see AprilTags::TagDetector::TagDetectorOptions
+      int tileSize;
+      int maxTagSize;
+      /// handling of tag ids detected more than once; use any but DUPLICATES_SHOW_AND_EXIT headless
+      DuplicateTagPolicy duplicateTagPolicy;
+      /// images computeObservations processes at once, including the calling thread (0 == one per core);
+      /// each image additionally uses numThreads threads
+      unsigned int batchThreads;
+      /// pool the tag detector runs on instead of its own numThreads threads, e.g. shared by the cameras of a rig
+      std::shared_ptr<AprilTags::ThreadPool> threadPool;
+      /// asynchronous computeObservation calls running at once (0 == one per core)
+      unsigned int asyncThreads;
+      /// find the tags on the image downsampled by this factor (1 == full resolution); the corners are
+      /// refined at full resolution, see AprilTags::TagDetector::TagDetectorOptions
+      int decimate;
+      /// computeObservationTracked runs full-frame detection at least every this many frames, to pick up
+      /// tags that came into view (0 == only when tags are lost)
+      unsigned int trackingFullFrameInterval;
+      /// computeObservationTracked searches each tag in the bounding box of its predicted corners grown by
+      /// trackingMargin [px] plus trackingMotionScale times the last motion of the tag [px per frame]
+      double trackingMargin;
+      double trackingMotionScale;
+      /// computeObservationFlow runs the tag detector at least every this many frames (0 == only when tracking fails)
+      unsigned int flowKeyframeInterval;
+      /// window size [px] and pyramid levels of the optical flow of computeObservationFlow
+      int flowWindowSize;
+      int flowPyramidLevels;
+      /// computeObservationFlow runs the tag detector if the RMS distance [px] of the tracked corners to the
+      /// board homography fitted to them exceeds flowMaxResidual; corners further than 3 * flowMaxResidual are dropped
+      double flowMaxResidual;
+      /// computeObservationFlow runs the tag detector if more than this fraction of the corners was lost
+      double flowMaxLostFraction;
+      /// look for the tags of the grid the tag detector missed (e.g. under glare) where a board homography
+      /// fitted to the detected tags predicts them, decoding only there (see AprilTags::TagDetector::decodeAt)
+      bool recoverMissingTags;
+      /// distance [px] the predicted tag sides are searched for the edges, covering lens distortion;
+      /// also the RANSAC threshold of the homography
+      double recoverySearchRange;
+      /// lens model of the camera: the tags are detected in undistorted coordinates without remapping the
+      /// image (see AprilTags::TagDetector::TagDetectorOptions), and observations also report the corners
+      /// undistorted. The corners are refined on the image as it is.
+      AprilTags::CameraModel camera;
+    };
+
+    /// \brief result of computeObservation for one image of computeObservations
+    struct Observation
+    {
+      Observation() : success(false){};
+      bool success;                       ///< return value of computeObservation
+      Eigen::MatrixXd imagePoints;        ///< N x 2 image points
+      Eigen::MatrixXd undistortedImagePoints; ///< imagePoints undistorted by options.camera (equal without distortion)
+      std::vector<bool> cornerObserved;   ///< N flags, all false if the observation failed
+      ObservationStatus status;
     };
 
+    /// \brief pose of the board in the camera frame, see estimatePose
+    struct BoardPose
+    {
+      BoardPose() : R(Eigen::Matrix3d::Identity()), t(Eigen::Vector3d::Zero()), rmsError(0), numPoints(0),
+                    numIterations(0){};
+      Eigen::Matrix3d R;  ///< rotation board to camera: x_camera = R * x_board + t
+      Eigen::Vector3d t;  ///< position of the board origin in the camera frame [m]
+      double rmsError;    ///< RMS reprojection error of the observed corners [px]
+      size_t numPoints;   ///< observed corners used
+      int numIterations;  ///< Gauss-Newton iterations run
+    };
+
+    /// \brief state computeObservationTracked carries from one frame to the next; owned by the caller,
+    /// one per video stream
+    struct TrackingState
+    {
+      TrackingState() : tags(),
+                        framesSinceFullFrame(0),
+                        fullFrame(false),
+                        numFullFrames(0),
+                        numTrackedFrames(0),
+                        numTrackingLost(0){};
+
+      /// \brief a tag of the last frame
+      struct Tag
+      {
+        int tagId;
+        double imagePoints[4][2]; ///< corners (x, y)
+        double motion[2];         ///< displacement of the tag centre since the frame before [px]
+      };
+
+      /// \brief forget the tags, so that the next frame runs full-frame detection (e.g. after a cut)
+      void reset() { tags.clear(); }
+
+      std::vector<Tag> tags;             ///< sorted by tagId
+      unsigned int framesSinceFullFrame; ///< frames since the last full-frame detection
+      bool fullFrame;                    ///< the last frame ran full-frame detection
+      size_t numFullFrames;              ///< frames that ran full-frame detection, including numTrackingLost
+      size_t numTrackedFrames;           ///< frames detected in the predicted regions only
+      size_t numTrackingLost;            ///< frames whose regions lost tags and that were detected again full-frame
+    };
+
+    /// \brief state computeObservationFlow carries from one frame to the next; owned by the caller,
+    /// one per video stream
+    struct FlowTrackingState
+    {
+      FlowTrackingState() : pyramid(),
+                            nextPyramid(),
+                            pointIds(),
+                            points(),
+                            framesSinceKeyframe(0),
+                            keyframe(false),
+                            residual(0),
+                            numKeyframes(0),
+                            numTrackedFrames(0),
+                            numTrackingLost(0){};
+
+      /// \brief forget the corners, so that the next frame runs the tag detector (e.g. after a cut)
+      void reset() { points.clear(); }
+
+      std::vector<cv::Mat> pyramid;     ///< optical flow pyramid of the last frame
+      std::vector<cv::Mat> nextPyramid; ///< scratch: pyramid of the current frame, its buffers are reused
+      std::vector<size_t> pointIds;     ///< grid point of each entry of points
+      std::vector<cv::Point2f> points;  ///< observed corners of the last frame
+      unsigned int framesSinceKeyframe; ///< frames since the tag detector ran
+      bool keyframe;                    ///< the last frame ran the tag detector
+      double residual;                  ///< RMS homography residual [px] of the last tracked frame
+      size_t numKeyframes;              ///< frames that ran the tag detector, including numTrackingLost
+      size_t numTrackedFrames;          ///< frames observed by optical flow only
+      size_t numTrackingLost;           ///< frames whose tracks failed validation and that ran the tag detector
+    };
+
+    /// \brief called with the result of an asynchronous computeObservation, on a thread of the executor
+    typedef std::function<void(Observation &observation)> ObservationCallback;
+
+    /// \brief one usable tag of the grid with its refined corners, see computeObservationProgressive
+    struct TagObservation
+    {
+      int tagId;
+      size_t pointIndices[4];   ///< grid point of each corner
+      double imagePoints[4][2]; ///< refined corners (x, y)
+      bool cornerObserved[4];   ///< false if refinement moved the corner further than maxSubpixDisplacement2
+    };
+
+    /// \brief called with each usable tag of computeObservationProgressive
+    typedef std::function<void(const TagObservation &tag)> TagObservationCallback;
+
+    /// \brief source of the images of computeObservations: stores the next image in image and returns true,
+    /// or returns false when there are no more images. Calls are serialized, but may come from any thread.
+    typedef std::function<bool(cv::Mat &image)> ImageProducer;
+
     AprilgridDetector(double tagSize,
                       double tagSpacing, const AprilgridOptions &options = AprilgridOptions());
 
+    /**
+     * @brief Aprilgrid of tagRows x tagCols tags with ids idOffset to idOffset + tagRows * tagCols - 1
+     *        (row by row, starting at the origin), e.g. one of several boards in view
+     */
+    AprilgridDetector(size_t tagRows, size_t tagCols, double tagSize, double tagSpacing, int idOffset = 0,
+                      const AprilgridOptions &options = AprilgridOptions());
+
     ~AprilgridDetector();
 
     /**
@@ -55,6 +304,139 @@ namespace calibration_toolkit
      * @return false
      */
     bool computeObservation(const cv::Mat &image, Eigen::MatrixXd &outImagePoints, std::vector<bool> &outCornerObserved) const;
+    /**
+     * @brief Same as above, additionally reporting the tag extraction diagnostics
+     * @param  outStatus        Stage sizes of the tag detector and the caps that triggered (if any);
+     *                          outStatus.partial is set if the deadline expired during tag extraction
+     * @param  deadline         Optional time budget; when it expires, the tags decoded so far are used
+     */
+    bool computeObservation(const cv::Mat &image, Eigen::MatrixXd &outImagePoints, std::vector<bool> &outCornerObserved,
+                            AprilTags::TagDetector::ExtractionStatus &outStatus,
+                            const AprilTags::TagDetector::Clock::time_point &deadline =
+                                AprilTags::TagDetector::Clock::time_point::max()) const;
+    /**
+     * @brief Same as above, reporting why a frame failed and how many tags and corners were dropped where
+     * @param  outStatus        outStatus.result is OBSERVATION_OK exactly if true is returned
+     */
+    bool computeObservation(const cv::Mat &image, Eigen::MatrixXd &outImagePoints, std::vector<bool> &outCornerObserved,
+                            ObservationStatus &outStatus,
+                            const AprilTags::TagDetector::Clock::time_point &deadline =
+                                AprilTags::TagDetector::Clock::time_point::max()) const;
+    /**
+     * @brief Same as above, writing into caller-owned buffers instead of resizing containers
+     * @param  outImagePoints    size() x 2 doubles, row major (x0, y0, x1, y1, ...); only observed corners are written
+     * @param  outCornerObserved size() flags, 1 (detected) or 0 (not detected)
+     * @return true  if outStatus.result is OBSERVATION_OK; the buffers are left untouched otherwise
+     */
+    bool computeObservation(const cv::Mat &image, double *outImagePoints, unsigned char *outCornerObserved,
+                            ObservationStatus &outStatus,
+                            const AprilTags::TagDetector::Clock::time_point &deadline =
+                                AprilTags::TagDetector::Clock::time_point::max()) const;
+    /**
+     * @brief computeObservation into an Observation; observation.cornerObserved is all false on failure
+     */
+    bool computeObservation(const cv::Mat &image, Observation &observation,
+                            const AprilTags::TagDetector::Clock::time_point &deadline =
+                                AprilTags::TagDetector::Clock::time_point::max()) const;
+    /**
+     * @brief computeObservation from the tags of an earlier extractTags call on image, e.g. one call for
+     *        several boards in view (see AprilgridMultiBoardDetector)
+     * @param  detections       tags extracted from image; those of other boards or families (TagDetection::family
+     *                          other than 0) count as numTagsOutOfRange
+     * @return observation.success; observation.status.extraction is left empty
+     */
+    bool computeObservation(const cv::Mat &image, const std::vector<AprilTags::TagDetection> &detections,
+                            Observation &observation) const;
+    /**
+     * @brief computeObservation reporting every usable tag as soon as it is decoded, e.g. to start pose
+     *        tracking or draw overlays before the frame is complete
+     * @param  onTag            called with each tag of this grid that is not near the border, from the threads
+     *                          of the tag detector, one at a time; keep it short, decoding waits for it.
+     *                          A later call for the same tagId supersedes an earlier one
+     * @param  onComplete       called with the observation once the frame is complete; this is authoritative,
+     *                          e.g. tags reported to onTag may have been dropped by the duplicate tag policy
+     * @return observation.success
+     */
+    bool computeObservationProgressive(const cv::Mat &image, const TagObservationCallback &onTag,
+                                       const ObservationCallback &onComplete,
+                                       const AprilTags::TagDetector::Clock::time_point &deadline =
+                                           AprilTags::TagDetector::Clock::time_point::max()) const;
+    /**
+     * @brief computeObservation for consecutive video frames, searching the tags only where the last frame
+     *        predicts them
+     *
+     * Each tag of the last frame is searched in the bounding box of its corners moved by the tag's last
+     * motion, grown by trackingMargin plus trackingMotionScale times that motion. The whole frame is
+     * searched instead on the first frame, every trackingFullFrameInterval frames, and again on the same
+     * frame if the predicted regions lose a tag or the observation fails. Tags coming into view are found
+     * by the next full-frame detection.
+     * @param  state            tracking state of the stream, updated; start with a default constructed one
+     * @return observation.success
+     */
+    bool computeObservationTracked(const cv::Mat &image, TrackingState &state, Observation &observation,
+                                   const AprilTags::TagDetector::Clock::time_point &deadline =
+                                       AprilTags::TagDetector::Clock::time_point::max()) const;
+    /**
+     * @brief computeObservation for high-rate video, tracking the observed corners with pyramidal optical
+     *        flow between keyframes that run the tag detector
+     *
+     * The corners of the last frame are tracked with cv::calcOpticalFlowPyrLK. The tracks are validated
+     * against a board-to-image homography fitted to them: the tag detector runs on this frame instead if
+     * their RMS residual exceeds flowMaxResidual, if more than flowMaxLostFraction of the corners were lost
+     * (failed, near the border or further than 3 * flowMaxResidual from the homography) or if less than
+     * minTagsForValidObs tags worth of corners remain. It also runs on the first frame and every
+     * flowKeyframeInterval frames. The homography is fitted in the undistorted coordinates of options.camera.
+     * Tracked frames report the corners in observation.status.numCornersObserved only.
+     * @param  state            tracking state of the stream, updated; start with a default constructed one
+     * @return observation.success
+     */
+    bool computeObservationFlow(const cv::Mat &image, FlowTrackingState &state, Observation &observation,
+                                const AprilTags::TagDetector::Clock::time_point &deadline =
+                                    AprilTags::TagDetector::Clock::time_point::max()) const;
+    /**
+     * @brief Queue computeObservation on the executor of the detector and return at once
+     * @param  image            Input image, must be gray; not copied (cv::Mat shares its buffer)
+     * @param  outTaskId        if not NULL, receives the id to cancel the call with, see executor()
+     * @return the observation; get() throws std::future_error (broken_promise) if the call was
+     *         cancelled before it started. The detector must outlive the call.
+     */
+    std::future<Observation> computeObservationAsync(const cv::Mat &image,
+                                                     AprilTags::Executor::TaskId *outTaskId = NULL) const;
+    /**
+     * @brief Same as above, calling onComplete with the observation instead of fulfilling a future
+     * @param  onCancelled      called instead of onComplete if the call is cancelled before it started, may be empty
+     * @return the id to cancel the call with
+     */
+    AprilTags::Executor::TaskId computeObservationAsync(const cv::Mat &image, const ObservationCallback &onComplete,
+                                                        const AprilTags::Executor::Task &onCancelled =
+                                                            AprilTags::Executor::Task()) const;
+    /// \brief runs the asynchronous calls of this detector and its copies with asyncThreads threads;
+    /// cancel queued calls here, e.g. to drop stale frames when the consumer falls behind
+    AprilTags::Executor &executor() const { return _tagDetector->executor(); }
+    /**
+     * @brief computeObservation for a batch of images, processing batchThreads images concurrently
+     * @param  images           Input images, must be gray
+     * @param  outObservations  Resized to images.size(); outObservations[i] is the observation of images[i]
+     * @return the number of successful observations
+     */
+    size_t computeObservations(const std::vector<cv::Mat> &images, std::vector<Observation> &outObservations) const;
+    /**
+     * @brief Same as above, pulling the images from producer until it returns false, so that only about
+     *        batchThreads images are held in memory at a time
+     * @param  outObservations  one observation per produced image, in the order they were produced
+     */
+    size_t computeObservations(const ImageProducer &producer, std::vector<Observation> &outObservations) const;
+    /**
+     * @brief Copy the observed corners of the buffer variant of computeObservation into compact caller-owned arrays
+     * @param  imagePoints      outImagePoints of computeObservation (size() x 2, row major)
+     * @param  cornerObserved   outCornerObserved of computeObservation
+     * @param  outIds           corner index of each observed corner, may be NULL
+     * @param  outImagePoints   observed image points (x, y), 2 doubles each, may be NULL
+     * @param  outObjectPoints  matching object points (x, y, z), 3 doubles each, may be NULL
+     * @return the number of observed corners n; each array must hold room for size() entries
+     */
+    size_t gatherObservedCorners(const double *imagePoints, const unsigned char *cornerObserved,
+                                 int *outIds, double *outImagePoints, double *outObjectPoints) const;
     /**
      * @brief Remove occluded grid points (flag  = false) from results of computeObservation
      * @param  inImagePoints    outImagePoints of computeObservation
@@ -63,12 +445,91 @@ namespace calibration_toolkit
      * @param  outImageP2ds     std vector of cv::Point2d
      */
     void convertResults_OpenCV(const Eigen::MatrixXd &inImagePoints, const std::vector<bool> &inCornerObserved,
-                               std::vector<cv::Point3d> &outObjectP3ds, std::vector<cv::Point2d> &outImageP2ds);
+                               std::vector<cv::Point3d> &outObjectP3ds, std::vector<cv::Point2d> &outImageP2ds) const;
+    /**
+     * @brief Same as above, gathering the observed points into matrices
+     * @param  outObjectPoints  n x 3 CV_64F matrix of object points (reallocated only if n changes)
+     * @param  outImagePoints   n x 2 CV_64F matrix of image points (reallocated only if n changes)
+     */
+    void convertResults_OpenCV(const Eigen::MatrixXd &inImagePoints, const std::vector<bool> &inCornerObserved,
+                               cv::Mat &outObjectPoints, cv::Mat &outImagePoints) const;
+    /**
+     * @brief Pose of the board from its observed corners, without cv::solvePnP
+     *
+     * Initialized in closed form from the board-to-image homography, then refined by Gauss-Newton on the
+     * reprojection error of all observed corners. Fixed-size matrices only, no heap allocations; a full
+     * board takes microseconds, cheap enough to run on every frame, e.g. for frame selection.
+     * @param  imagePoints      N x 2 corners of an ideal pinhole camera, i.e. undistorted pixel coordinates
+     *                          (see Observation::undistortedImagePoints)
+     * @param  cornerObserved   N flags, only the observed corners are used
+     * @param  fx, fy, cx, cy   intrinsics [px]
+     * @param  maxIterations    Gauss-Newton iterations at most; it stops earlier once the update is negligible
+     * @return false if less than 4 corners are observed or they do not determine a pose (e.g. all on a line)
+     */
+    bool estimatePose(const Eigen::MatrixXd &imagePoints, const std::vector<bool> &cornerObserved,
+                      double fx, double fy, double cx, double cy, BoardPose &outPose, int maxIterations = 10) const;
+    /**
+     * @brief Same as above for an observation, from its undistortedImagePoints and the intrinsics of
+     *        options.camera, which must be set (with DISTORTION_NONE for images without distortion)
+     * @return false also if the observation failed
+     */
+    bool estimatePose(const Observation &observation, BoardPose &outPose, int maxIterations = 10) const;
 
   private:
     void initialize();
     void createGridPoints();
 
+    /// \brief computeObservation writing point i to (outImagePoints[i * rowStride], outImagePoints[i * rowStride + colStride])
+    /// and passing onTag on to the tag detector; only searches inside rois if not NULL (onTag is not called then)
+    bool observe(const cv::Mat &image, double *outImagePoints, size_t rowStride, size_t colStride,
+                 unsigned char *outCornerObserved, ObservationStatus &outStatus,
+                 const AprilTags::TagDetector::TagCallback &onTag,
+                 const AprilTags::TagDetector::Clock::time_point &deadline,
+                 const std::vector<cv::Rect> *rois = NULL) const;
+
+    /// \brief the part of observe after tag extraction, adding to outStatus
+    bool observeDetections(const cv::Mat &image, std::vector<AprilTags::TagDetection> &detections,
+                           double *outImagePoints, size_t rowStride, size_t colStride,
+                           unsigned char *outCornerObserved, ObservationStatus &outStatus) const;
+
+    /// \brief the regions computeObservationTracked searches for the tags of state
+    void predictTagRegions(const TrackingState &state, const cv::Mat &image, std::vector<cv::Rect> &rois) const;
+
+    /// \brief true if a corner of the tag is observed
+    bool tagObserved(const Observation &observation, int tagId) const;
+
+    /// \brief track the corners of state into state.nextPyramid (numLevels levels); false if the tracks fail validation
+    bool trackCorners(const cv::Mat &image, int numLevels, FlowTrackingState &state, Observation &observation) const;
+
+    /// \brief replace the tags of state by those of observation
+    void updateTracking(const Observation &observation, TrackingState &state) const;
+
+    /// \brief fill observation.undistortedImagePoints from its observed image points
+    void undistortObservation(Observation &observation) const;
+
+    /// \brief refine the tag corners (4 rows per tag, CV_32F) with the method of cornerRefinement
+    void refineCorners(const cv::Mat &image, cv::Mat &tagCorners) const;
+
+    /// \brief true if a corner of the tag is closer than minBorderDistance to the image border
+    bool nearBorder(const AprilTags::TagDetection &detection, const cv::Mat &image) const;
+
+    /// \brief true if the tag id belongs to this grid
+    bool onGrid(int tagId) const { return tagId >= _idOffset && tagId < _idOffset + (int)size() / 4; }
+
+    /// \brief the grid points of the four corners of a tag of this grid
+    void tagPointIndices(int tagId, size_t pointIndices[4]) const;
+
+    /// \brief refine the corners of a single tag for computeObservationProgressive; false if it is not usable
+    bool observeTag(const cv::Mat &image, const AprilTags::TagDetection &detection, TagObservation &tag) const;
+
+    /// \brief add the tags of the grid missing from detections that decode where the others predict them
+    void recoverTags(const cv::Mat &image, std::vector<AprilTags::TagDetection> &detections,
+                     ObservationStatus &status) const;
+
+    /// \brief apply the duplicate tag policy (except DUPLICATES_SHOW_AND_EXIT) to detections sorted by id;
+    /// \return false if the frame is to be rejected
+    bool resolveDuplicateTags(std::vector<AprilTags::TagDetection> &detections, ObservationStatus &status) const;
+
   public:
     inline size_t size() const { return _rows * _cols; };
 
@@ -78,11 +539,17 @@ namespace calibration_toolkit
     /// \brief the number of columns in the calibration target
     inline size_t cols() const { return _cols; };
 
+    /// \brief the id of the first tag; the tags of the grid have consecutive ids
+    inline int idOffset() const { return _idOffset; };
+
+    /// \brief the tag detector, e.g. to extract the tags once for several grids
+    const AprilTags::TagDetector &tagDetector() const { return *_tagDetector; }
+
     /// \brief get a point from the target expressed in the target frame
     Eigen::Vector3d point(size_t i) const;
 
     /// \brief get all points from the target expressed in the target frame
-    Eigen::MatrixXd points() const;
+    const PointMatrix &points() const { return _points; }
 
     /// \brief get the grid coordinates for a point
     std::pair<size_t, size_t> pointToGridCoordinates(size_t i) const;
@@ -96,7 +563,7 @@ namespace calibration_toolkit
     double *getPointDataPointer(size_t i);
 
   private:
-    Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> _points;
+    PointMatrix _points;
 
     /// \brief the number of point rows in the calibration target
     size_t _rows;
@@ -110,6 +577,9 @@ namespace calibration_toolkit
     /// \brief space between tags (tagSpacing [m] = tagSize * tagSpacing)
     double _tagSpacing;
 
+    /// \brief id of the first tag
+    int _idOffset;
+
     /// \brief target extraction options
     AprilgridOptions _options;
     AprilTags::TagCodes _tagCodes;
@@ -0,0 +1,71 @@
+#ifndef APRILTAGS_GRIDMULTIBOARD_HPP
+#define APRILTAGS_GRIDMULTIBOARD_HPP
+
+#include <memory>
+#include <vector>
+#include "gridDetector.hpp"
+
+namespace calibration_toolkit
+{
+
+  /**
+   * @brief Detection of several aprilgrids in view of one camera
+   *
+   * The boards use disjoint ranges of tag ids. The tags of an image are
+   * extracted once and assigned to the boards by id, so that N boards cost one
+   * tag extraction rather than N; only the corner refinement runs per board.
+   *
+   * computeObservations may be called concurrently, under the same conditions
+   * as AprilgridDetector::computeObservation.
+   */
+  class AprilgridMultiBoardDetector
+  {
+  public:
+    /// \brief geometry of one board, see AprilgridDetector
+    struct BoardDefinition
+    {
+      BoardDefinition(size_t tagRows, size_t tagCols, double tagSize, double tagSpacing, int idOffset)
+          : tagRows(tagRows), tagCols(tagCols), tagSize(tagSize), tagSpacing(tagSpacing), idOffset(idOffset){};
+      size_t tagRows;
+      size_t tagCols;
+      double tagSize;    ///< [m]
+      double tagSpacing; ///< space between tags as a fraction of tagSize
+      int idOffset;      ///< id of the first tag; the board uses tagRows * tagCols consecutive ids
+    };
+
+    /// \brief options shared by all boards; the tag detector options of the first board extract the tags
+    explicit AprilgridMultiBoardDetector(
+        const AprilgridDetector::AprilgridOptions &options = AprilgridDetector::AprilgridOptions());
+
+    /**
+     * @brief Add a board; its id range must not overlap the ones of the boards added before
+     * @return the index of the board in the observations
+     */
+    size_t addBoard(const BoardDefinition &board);
+
+    inline size_t numBoards() const { return _detectors.size(); };
+
+    /// \brief the detector of a board, e.g. for its object points
+    const AprilgridDetector &detector(size_t board) const { return _detectors[board]; }
+
+    /**
+     * @brief Find the boards in an image
+     * @param  image            Input image, must be gray
+     * @param  outObservations  resized to numBoards(); outObservations[i] is the observation of board i, each
+     *                          with the status of the shared tag extraction
+     * @param  deadline         Optional time budget of the tag extraction, see AprilgridDetector::computeObservation
+     * @return the number of boards observed successfully
+     */
+    size_t computeObservations(const cv::Mat &image,
+                               std::vector<AprilgridDetector::Observation> &outObservations,
+                               const AprilTags::TagDetector::Clock::time_point &deadline =
+                                   AprilTags::TagDetector::Clock::time_point::max()) const;
+
+  private:
+    AprilgridDetector::AprilgridOptions _options;
+    std::vector<AprilgridDetector> _detectors;
+  };
+
+} // namespace calibration_toolkit
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef APRILTAGS_GRIDPIPELINE_HPP
+#define APRILTAGS_GRIDPIPELINE_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include "gridDetector.hpp"
+
+namespace calibration_toolkit
+{
+
+  /**
+   * @brief Streaming front end of an AprilgridDetector for live video
+   *
+   * Frames pushed by the capture thread wait in a bounded queue until one of the
+   * worker threads is free, so consecutive frames are detected concurrently.
+   * pop() returns the results in the order the frames were pushed, skipping
+   * frames dropped by the backpressure policy.
+   *
+   * push() and pop() may be called from different threads. The image passed to
+   * push() is not copied (cv::Mat shares its buffer), pass a clone if the camera
+   * driver reuses the buffer.
+   */
+  class AprilgridPipeline
+  {
+  public:
+    typedef AprilTags::TagDetector::Clock Clock;
+
+    /// \brief what push does when the queue is full
+    enum BackpressurePolicy
+    {
+      BACKPRESSURE_BLOCK,       ///< wait until a worker takes a frame from the queue
+      BACKPRESSURE_DROP_OLDEST, ///< drop the oldest waiting frame to make room
+      BACKPRESSURE_KEEP_LATEST  ///< drop all waiting frames, so workers always start on the newest one
+    };
+
+    struct PipelineOptions
+    {
+      PipelineOptions() : numWorkers(2),
+                          queueSize(4),
+                          backpressurePolicy(BACKPRESSURE_BLOCK){};
+      /// frames detected concurrently; each one additionally uses AprilgridOptions::numThreads threads
+      unsigned int numWorkers;
+      /// frames waiting for a worker, at least 1
+      size_t queueSize;
+      BackpressurePolicy backpressurePolicy;
+    };
+
+    /// \brief observation of one frame
+    struct Result
+    {
+      Result() : frameId(0), queueDepth(0), queueSeconds(0), latencySeconds(0){};
+      uint64_t frameId; ///< frames are numbered from 0 in push order, including dropped ones
+      AprilgridDetector::Observation observation;
+      size_t queueDepth;     ///< frames waiting in the queue when this one was pushed
+      double queueSeconds;   ///< push until a worker started on the frame
+      double latencySeconds; ///< push until the observation was complete
+    };
+
+    struct Statistics
+    {
+      Statistics() : framesPushed(0),
+                     framesDropped(0),
+                     framesCompleted(0),
+                     queueDepth(0),
+                     maxQueueDepth(0),
+                     framesInProgress(0),
+                     lastLatencySeconds(0),
+                     meanLatencySeconds(0),
+                     maxLatencySeconds(0){};
+      size_t framesPushed;
+      size_t framesDropped;
+      size_t framesCompleted;
+      size_t queueDepth;       ///< frames waiting for a worker now
+      size_t maxQueueDepth;
+      size_t framesInProgress; ///< frames being detected now
+      double lastLatencySeconds;
+      double meanLatencySeconds;
+      double maxLatencySeconds;
+    };
+
+    /// \brief start the workers; the detector is copied and shares its tag detector with the original
+    AprilgridPipeline(const AprilgridDetector &detector, const PipelineOptions &options = PipelineOptions());
+
+    /// \brief drop the waiting frames, finish the ones in progress and stop the workers
+    ~AprilgridPipeline();
+
+    /**
+     * @brief Queue a frame for detection
+     * @param  image            Input image, must be gray
+     * @return false if the pipeline was closed; the frame is not queued then
+     */
+    bool push(const cv::Mat &image);
+
+    /// \brief no more frames will be pushed; pop() returns false once all results were returned
+    void close();
+
+    /**
+     * @brief Wait for the result of the next frame in push order
+     * @return false if the pipeline was closed and all results were returned
+     */
+    bool pop(Result &result);
+
+    /// \brief same as above without waiting; false if the result of the next frame is not ready yet
+    bool tryPop(Result &result);
+
+    Statistics statistics() const;
+
+  private:
+    struct Frame
+    {
+      uint64_t id;
+      cv::Mat image;
+      Clock::time_point pushTime;
+      size_t queueDepth;
+    };
+
+    AprilgridPipeline(const AprilgridPipeline &);            ///< don't call
+    AprilgridPipeline &operator=(const AprilgridPipeline &); ///< don't call
+
+    void workerLoop();
+
+    /// \brief mark a waiting frame as dropped; mutex must be held
+    void dropFrame(const Frame &frame);
+
+    /// \brief move the result of the next frame to result if it is ready; mutex must be held
+    bool takeNext(Result &result);
+
+    const AprilgridDetector _detector;
+    const PipelineOptions _options;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _frameQueued;   ///< a frame was queued or the pipeline was closed
+    std::condition_variable _frameTaken;    ///< a worker took a frame from the queue
+    std::condition_variable _resultReady;   ///< a frame completed or was dropped
+    std::deque<Frame> _queue;
+    std::map<uint64_t, Result> _completed; ///< completed frames not yet popped
+    std::set<uint64_t> _dropped;           ///< dropped frames pop() did not pass yet
+    uint64_t _nextFrameId;
+    uint64_t _nextResultId;
+    bool _closed;
+    Statistics _statistics;
+    double _totalLatencySeconds;
+
+    std::vector<std::thread> _workers;
+  };
+
+} // namespace calibration_toolkit
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef APRILTAGS_GRIDRIG_HPP
+#define APRILTAGS_GRIDRIG_HPP
+
+#include <memory>
+#include <vector>
+#include "gridDetector.hpp"
+
+namespace calibration_toolkit
+{
+
+  /**
+   * @brief Detection of the aprilgrid in synchronized frame sets of a multi-camera rig
+   *
+   * Each camera has its own AprilgridDetector and options. All detectors run on
+   * one thread pool owned by the rig: the images of a frame set are detected
+   * concurrently, largest first, and the parallel stages of each detector use
+   * the threads the other cameras no longer need. The latency of a frame set
+   * thus approaches the one of the slowest camera rather than their sum.
+   *
+   * computeObservations may be called concurrently, under the same conditions
+   * as AprilgridDetector::computeObservation.
+   */
+  class AprilgridRigDetector
+  {
+  public:
+    /// \brief create the thread pool of numThreads threads, including the calling thread (0 == one per core)
+    explicit AprilgridRigDetector(unsigned int numThreads = 0);
+
+    /**
+     * @brief Add a camera
+     * @param  tagSize, tagSpacing, options  See AprilgridDetector; options.numThreads and options.threadPool
+     *                                       are ignored, the detector runs on the pool of the rig
+     * @return the index of the camera in the frame sets
+     */
+    size_t addCamera(double tagSize, double tagSpacing,
+                     const AprilgridDetector::AprilgridOptions &options = AprilgridDetector::AprilgridOptions());
+
+    inline size_t numCameras() const { return _detectors.size(); };
+
+    /// \brief the detector of a camera
+    const AprilgridDetector &detector(size_t camera) const { return _detectors[camera]; }
+
+    /**
+     * @brief Find the aprilgrid in the images of one frame set
+     * @param  images           one image per camera, in the order the cameras were added; must be gray
+     * @param  outObservations  resized to numCameras(); outObservations[i] is the observation of images[i]
+     * @param  deadline         Optional time budget of the whole frame set, see AprilgridDetector::computeObservation
+     * @return the number of successful observations
+     */
+    size_t computeObservations(const std::vector<cv::Mat> &images,
+                               std::vector<AprilgridDetector::Observation> &outObservations,
+                               const AprilTags::TagDetector::Clock::time_point &deadline =
+                                   AprilTags::TagDetector::Clock::time_point::max()) const;
+
+  private:
+    std::shared_ptr<AprilTags::ThreadPool> _threadPool;
+    std::vector<AprilgridDetector> _detectors;
+  };
+
+} // namespace calibration_toolkit
+
+#endif
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cmath>
+
+#include "apriltags/CameraModel.h"
+
+namespace AprilTags
+{
+
+  namespace
+  {
+    const int MAX_ITERATIONS = 20;
+    //! convergence threshold, in normalized coordinates (about 1e-6 pixels)
+    const double EPSILON = 1e-9;
+  }
+
+  CameraModel::CameraModel() : model(DISTORTION_NONE), fx(1), fy(1), cx(0), cy(0)
+  {
+    std::fill(k, k + 5, 0.0);
+  }
+
+  CameraModel::CameraModel(double fx, double fy, double cx, double cy, DistortionModel model,
+                           const std::vector<double> &coefficients)
+      : model(model), fx(fx), fy(fy), cx(cx), cy(cy)
+  {
+    std::fill(k, k + 5, 0.0);
+    std::copy(coefficients.begin(), coefficients.begin() + std::min<size_t>(coefficients.size(), 5), k);
+  }
+
+  void CameraModel::distortNormalized(double x, double y, double &xd, double &yd, double *J) const
+  {
+    if (model == DISTORTION_RADTAN)
+    {
+      const double k1 = k[0], k2 = k[1], p1 = k[2], p2 = k[3], k3 = k[4];
+      double r2 = x * x + y * y;
+      double radial = 1 + r2 * (k1 + r2 * (k2 + r2 * k3));
+      xd = x * radial + 2 * p1 * x * y + p2 * (r2 + 2 * x * x);
+      yd = y * radial + p1 * (r2 + 2 * y * y) + 2 * p2 * x * y;
+      if (J)
+      {
+        double dRadial = k1 + r2 * (2 * k2 + 3 * k3 * r2); // d radial / d r2
+        J[0] = radial + 2 * x * x * dRadial + 2 * p1 * y + 6 * p2 * x;
+        J[1] = 2 * x * y * dRadial + 2 * p1 * x + 2 * p2 * y;
+        J[2] = J[1];
+        J[3] = radial + 2 * y * y * dRadial + 6 * p1 * y + 2 * p2 * x;
+      }
+    }
+    else if (model == DISTORTION_EQUIDISTANT)
+    {
+      double r = std::sqrt(x * x + y * y);
+      double theta = std::atan(r);
+      double theta2 = theta * theta;
+      double thetaD = theta * (1 + theta2 * (k[0] + theta2 * (k[1] + theta2 * (k[2] + theta2 * k[3]))));
+      double scale = r > 1e-12 ? thetaD / r : 1;
+      xd = x * scale;
+      yd = y * scale;
+    }
+    else
+    {
+      xd = x;
+      yd = y;
+    }
+  }
+
+  std::pair<float, float> CameraModel::distort(const std::pair<float, float> &undistortedPoint) const
+  {
+    if (model == DISTORTION_NONE)
+      return undistortedPoint;
+
+    double xd, yd;
+    distortNormalized((undistortedPoint.first - cx) / fx, (undistortedPoint.second - cy) / fy, xd, yd, 0);
+    return std::make_pair((float)(fx * xd + cx), (float)(fy * yd + cy));
+  }
+
+  std::pair<float, float> CameraModel::undistort(const std::pair<float, float> &imagePoint) const
+  {
+    if (model == DISTORTION_NONE)
+      return imagePoint;
+
+    const double xd = (imagePoint.first - cx) / fx;
+    const double yd = (imagePoint.second - cy) / fy;
+    double x = xd, y = yd;
+
+    if (model == DISTORTION_EQUIDISTANT)
+    {
+      // the distortion only scales the radius: solve theta_d(theta) = |(xd, yd)| by Newton
+      double thetaD = std::sqrt(xd * xd + yd * yd);
+      double theta = thetaD;
+      for (int i = 0; i < MAX_ITERATIONS; i++)
+      {
+        double theta2 = theta * theta;
+        double f = theta * (1 + theta2 * (k[0] + theta2 * (k[1] + theta2 * (k[2] + theta2 * k[3])))) - thetaD;
+        double df = 1 + theta2 * (3 * k[0] + theta2 * (5 * k[1] + theta2 * (7 * k[2] + theta2 * 9 * k[3])));
+        double step = f / df;
+        theta -= step;
+        if (std::fabs(step) < EPSILON)
+          break;
+      }
+      // points at 90 degrees and beyond have no pinhole projection
+      theta = std::min(theta, 1.5);
+      double scale = thetaD > 1e-12 ? std::tan(theta) / thetaD : 1;
+      x = xd * scale;
+      y = yd * scale;
+    }
+    else
+    {
+      // Gauss-Newton on distort(x, y) == (xd, yd), starting at the distorted point
+      for (int i = 0; i < MAX_ITERATIONS; i++)
+      {
+        double fxd, fyd, J[4];
+        distortNormalized(x, y, fxd, fyd, J);
+        double ex = xd - fxd, ey = yd - fyd;
+        double det = J[0] * J[3] - J[1] * J[2];
+        if (std::fabs(det) < 1e-12)
+          break;
+        double dx = (J[3] * ex - J[1] * ey) / det;
+        double dy = (J[0] * ey - J[2] * ex) / det;
+        x += dx;
+        y += dy;
+        if (dx * dx + dy * dy < EPSILON * EPSILON)
+          break;
+      }
+    }
+    return std::make_pair((float)(fx * x + cx), (float)(fy * y + cy));
+  }
+
+} // namespace
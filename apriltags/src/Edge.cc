@@ -25,50 +25,39 @@ namespace AprilTags
     return (int)(normErr * WEIGHT_SCALE);
   }
 
-  void Edge::calcEdges(float theta0, int x, int y,
-                       const FloatImage &theta, const FloatImage &mag,
-                       std::vector<Edge> &edges, size_t &nEdges)
+  void Edge::calcEdgeCosts(float theta0, int x, int y,
+                           const FloatImage &theta, const FloatImage &mag, int costs[4])
   {
-    int width = theta.getWidth();
-    int thisPixel = y * width + x;
-
     // horizontal edge
-    int cost1 = edgeCost(theta0, theta.get(x + 1, y), mag.get(x + 1, y));
-    if (cost1 >= 0)
-    {
-      edges[nEdges].cost = cost1;
-      edges[nEdges].pixelIdxA = thisPixel;
-      edges[nEdges].pixelIdxB = y * width + x + 1;
-      ++nEdges;
-    }
+    costs[0] = edgeCost(theta0, theta.get(x + 1, y), mag.get(x + 1, y));
 
     // vertical edge
-    int cost2 = edgeCost(theta0, theta.get(x, y + 1), mag.get(x, y + 1));
-    if (cost2 >= 0)
-    {
-      edges[nEdges].cost = cost2;
-      edges[nEdges].pixelIdxA = thisPixel;
-      edges[nEdges].pixelIdxB = (y + 1) * width + x;
-      ++nEdges;
-    }
+    costs[1] = edgeCost(theta0, theta.get(x, y + 1), mag.get(x, y + 1));
 
     // downward diagonal edge
-    int cost3 = edgeCost(theta0, theta.get(x + 1, y + 1), mag.get(x + 1, y + 1));
-    if (cost3 >= 0)
-    {
-      edges[nEdges].cost = cost3;
-      edges[nEdges].pixelIdxA = thisPixel;
-      edges[nEdges].pixelIdxB = (y + 1) * width + x + 1;
-      ++nEdges;
-    }
+    costs[2] = edgeCost(theta0, theta.get(x + 1, y + 1), mag.get(x + 1, y + 1));
 
     // updward diagonal edge
-    int cost4 = (x == 0) ? -1 : edgeCost(theta0, theta.get(x - 1, y + 1), mag.get(x - 1, y + 1));
-    if (cost4 >= 0)
+    costs[3] = (x == 0) ? -1 : edgeCost(theta0, theta.get(x - 1, y + 1), mag.get(x - 1, y + 1));
+  }
+
+  void Edge::calcEdges(float theta0, int x, int y,
+                       const FloatImage &theta, const FloatImage &mag,
+                       std::vector<Edge> &edges, size_t &nEdges)
+  {
+    int width = theta.getWidth();
+    int thisPixel = y * width + x;
+    const int neighbors[4] = {y * width + x + 1, (y + 1) * width + x, (y + 1) * width + x + 1, (y + 1) * width + x - 1};
+
+    int costs[4];
+    calcEdgeCosts(theta0, x, y, theta, mag, costs);
+    for (int k = 0; k < 4; k++)
     {
-      edges[nEdges].cost = cost4;
+      if (costs[k] < 0)
+        continue;
+      edges[nEdges].cost = costs[k];
       edges[nEdges].pixelIdxA = thisPixel;
-      edges[nEdges].pixelIdxB = (y + 1) * width + x - 1;
+      edges[nEdges].pixelIdxB = neighbors[k];
       ++nEdges;
     }
   }
@@ -76,7 +65,13 @@ namespace AprilTags
   void Edge::mergeEdges(std::vector<Edge> &edges, UnionFindSimple &uf,
                         float tmin[], float tmax[], float mmin[], float mmax[])
   {
-    for (size_t i = 0; i < edges.size(); i++)
+    mergeEdges(edges.empty() ? NULL : &edges[0], edges.size(), uf, tmin, tmax, mmin, mmax);
+  }
+
+  void Edge::mergeEdges(const Edge *edges, size_t nEdges, UnionFindSimple &uf,
+                        float tmin[], float tmax[], float mmin[], float mmax[])
+  {
+    for (size_t i = 0; i < nEdges; i++)
     {
       int ida = edges[i].pixelIdxA;
       int idb = edges[i].pixelIdxB;
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cmath>
+
+#include "apriltags/EdgeRefiner.h"
+#include "apriltags/GLine2D.h"
+
+namespace AprilTags
+{
+
+  EdgeRefiner::EdgeRefiner(float searchRange, const CameraModel *camera)
+      : searchRange(std::min(searchRange, 0.25f * (MAX_STEPS - 1) / 2)), camera(camera) {}
+
+  bool EdgeRefiner::sample(const cv::Mat &image, float x, float y, float &value) const
+  {
+    if (camera && camera->hasDistortion())
+    {
+      std::pair<float, float> p = camera->distort(std::make_pair(x, y));
+      x = p.first;
+      y = p.second;
+    }
+    int x0 = (int)std::floor(x);
+    int y0 = (int)std::floor(y);
+    if (x0 < 0 || y0 < 0 || x0 + 1 >= image.cols || y0 + 1 >= image.rows)
+      return false;
+
+    float ax = x - x0;
+    float ay = y - y0;
+    const uchar *row0 = image.ptr<uchar>(y0) + x0;
+    const uchar *row1 = image.ptr<uchar>(y0 + 1) + x0;
+    value = (1 - ay) * ((1 - ax) * row0[0] + ax * row0[1]) + ay * ((1 - ax) * row1[0] + ax * row1[1]);
+    return true;
+  }
+
+  bool EdgeRefiner::refine(const cv::Mat &image, std::pair<float, float> corners[4]) const
+  {
+    std::vector<XYWeight> samples;
+    return refine(image, corners, samples);
+  }
+
+  bool EdgeRefiner::refine(const cv::Mat &image, std::pair<float, float> corners[4],
+                           std::vector<XYWeight> &samples) const
+  {
+    // the normals of the sides point away from the centre of the quad
+    float cx = 0, cy = 0;
+    for (int i = 0; i < 4; i++)
+    {
+      cx += corners[i].first / 4;
+      cy += corners[i].second / 4;
+    }
+
+    GLine2D sides[4];
+    for (int i = 0; i < 4; i++)
+    {
+      const std::pair<float, float> &a = corners[i];
+      const std::pair<float, float> &b = corners[(i + 1) % 4];
+      float dx = b.first - a.first;
+      float dy = b.second - a.second;
+      float length = std::sqrt(dx * dx + dy * dy);
+      if (length < 1)
+        return false;
+
+      float nx = dy / length;
+      float ny = -dx / length;
+      if (nx * (a.first - cx) + ny * (a.second - cy) < 0)
+      {
+        nx = -nx;
+        ny = -ny;
+      }
+
+      // about one sample every other pixel, keeping clear of the corners
+      const int numSamples = std::max(2, (int)(length / 2));
+      samples.clear();
+      for (int s = 0; s < numSamples; s++)
+      {
+        float alpha = (s + 1.0f) / (numSamples + 1);
+        float px = a.first + alpha * dx;
+        float py = a.second + alpha * dy;
+
+        // centroid of the dark-to-bright gradient along the normal; only the part above
+        // half of the peak counts, so that noise does not pull it to the middle of the range
+        float gradients[MAX_STEPS];
+        float peak = 0;
+        int numSteps = 0;
+        for (float n = -searchRange; n <= searchRange && numSteps < MAX_STEPS; n += 0.25f, numSteps++)
+        {
+          float outer, inner;
+          gradients[numSteps] = 0;
+          if (!sample(image, px + (n + 1) * nx, py + (n + 1) * ny, outer) ||
+              !sample(image, px + (n - 1) * nx, py + (n - 1) * ny, inner))
+            continue;
+          gradients[numSteps] = outer - inner;
+          peak = std::max(peak, gradients[numSteps]);
+        }
+        float moment = 0, weight = 0;
+        for (int k = 0; k < numSteps; k++)
+        {
+          float gradient = gradients[k] - 0.5f * peak;
+          if (gradient <= 0)
+            continue;
+          moment += gradient * (-searchRange + 0.25f * k);
+          weight += gradient;
+        }
+        if (weight <= 0)
+          continue;
+
+        // relative to a, which keeps the float sums of the fit small
+        float n = moment / weight;
+        samples.push_back(XYWeight(alpha * dx + n * nx, alpha * dy + n * ny, weight));
+      }
+      if (samples.size() < 2)
+        return false;
+
+      GLine2D fit = GLine2D::lsqFitXYW(samples);
+      sides[i] = GLine2D(fit.getDx(), fit.getDy(),
+                         std::make_pair(fit.getFirst() + a.first, fit.getSecond() + a.second));
+    }
+
+    // corner i lies between side i-1 and side i
+    std::pair<float, float> refined[4];
+    for (int i = 0; i < 4; i++)
+    {
+      refined[i] = sides[(i + 3) % 4].intersectionWith(sides[i]);
+      float dx = refined[i].first - corners[i].first;
+      float dy = refined[i].second - corners[i].second;
+      // parallel sides, or the fit ran off to another edge
+      if (refined[i].first == -1 || dx * dx + dy * dy > 4 * searchRange * searchRange)
+        return false;
+    }
+
+    std::copy(refined, refined + 4, corners);
+    return true;
+  }
+
+} // namespace
@@ -0,0 +1,103 @@
+#include <algorithm>
+
+#include "apriltags/Executor.h"
+
+namespace AprilTags
+{
+
+  Executor::Executor(unsigned int numThreads)
+      : workers(), queue(), nextId(1), mutex(), taskAvailable(), stopping(false)
+  {
+    if (numThreads == 0)
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int i = 0; i < numThreads; i++)
+      workers.push_back(std::thread(&Executor::workerLoop, this));
+  }
+
+  Executor::~Executor()
+  {
+    cancelAll();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    taskAvailable.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+      workers[i].join();
+  }
+
+  Executor::TaskId Executor::submit(const Task &task, const Task &onCancel)
+  {
+    TaskId id;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      id = nextId++;
+      Entry entry = {id, task, onCancel};
+      queue.push_back(entry);
+    }
+    taskAvailable.notify_one();
+    return id;
+  }
+
+  bool Executor::cancel(TaskId id)
+  {
+    Entry entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::deque<Entry>::iterator it = queue.begin();
+      while (it != queue.end() && it->id != id)
+        ++it;
+      if (it == queue.end())
+        return false;
+      entry = *it;
+      queue.erase(it);
+    }
+
+    // outside the lock, so onCancel may submit new tasks
+    if (entry.onCancel)
+      entry.onCancel();
+    return true;
+  }
+
+  size_t Executor::cancelAll()
+  {
+    std::deque<Entry> cancelled;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      cancelled.swap(queue);
+    }
+
+    for (size_t i = 0; i < cancelled.size(); i++)
+      if (cancelled[i].onCancel)
+        cancelled[i].onCancel();
+    return cancelled.size();
+  }
+
+  size_t Executor::numQueued() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+  }
+
+  void Executor::workerLoop()
+  {
+    while (true)
+    {
+      Entry entry;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping && queue.empty())
+          taskAvailable.wait(lock);
+        if (queue.empty())
+          return;
+
+        entry = queue.front();
+        queue.pop_front();
+      }
+
+      entry.task();
+    }
+  }
+
+} // namespace
@@ -1,5 +1,6 @@
 #include "apriltags/FloatImage.h"
 #include "apriltags/Gaussian.h"
+#include "apriltags/ThreadPool.h"
 #include <iostream>
 
 namespace AprilTags
@@ -23,20 +24,57 @@ namespace AprilTags
     return *this;
   }
 
+  void FloatImage::resize(int widthArg, int heightArg)
+  {
+    width = widthArg;
+    height = heightArg;
+    pixels.resize(widthArg * heightArg);
+  }
+
   void FloatImage::decimateAvg()
   {
     int nWidth = width / 2;
     int nHeight = height / 2;
 
+    // in place: every output pixel lies before the block it is read from
     for (int y = 0; y < nHeight; y++)
       for (int x = 0; x < nWidth; x++)
-        pixels[y * nWidth + x] = pixels[(2 * y) * width + (2 * x)];
+      {
+        const float *row0 = &pixels[(2 * y) * width + (2 * x)];
+        const float *row1 = row0 + width;
+        pixels[y * nWidth + x] = 0.25f * (row0[0] + row0[1] + row1[0] + row1[1]);
+      }
 
     width = nWidth;
     height = nHeight;
     pixels.resize(nWidth * nHeight);
   }
 
+  void FloatImage::decimateAvg(const FloatImage &source, int factor, ThreadPool *pool)
+  {
+    resize(source.width / factor, source.height / factor);
+    const float scale = 1.0f / (factor * factor);
+
+    ThreadPool::Body decimateRows = [&](int y0, int y1) {
+      for (int y = y0; y < y1; y++)
+        for (int x = 0; x < width; x++)
+        {
+          float sum = 0;
+          for (int by = 0; by < factor; by++)
+          {
+            const float *row = &source.pixels[(y * factor + by) * source.width + x * factor];
+            for (int bx = 0; bx < factor; bx++)
+              sum += row[bx];
+          }
+          pixels[y * width + x] = sum * scale;
+        }
+    };
+    if (pool)
+      pool->parallelFor(height, pool->chunkSize(height), decimateRows);
+    else
+      decimateRows(0, height);
+  }
+
   void FloatImage::normalize()
   {
     const float maxVal = *max_element(pixels.begin(), pixels.end());
@@ -49,19 +87,44 @@ namespace AprilTags
 
   void FloatImage::filterFactoredCentered(const std::vector<float> &fhoriz, const std::vector<float> &fvert)
   {
-    // do horizontal
-    std::vector<float> r(pixels);
+    std::vector<float> scratch;
+    filterFactoredCentered(fhoriz, fvert, scratch);
+  }
+
+  void FloatImage::filterFactoredCentered(const std::vector<float> &fhoriz, const std::vector<float> &fvert,
+                                          std::vector<float> &scratch, ThreadPool *pool)
+  {
+    // do horizontal (into scratch, which is only ever grown)
+    if (scratch.size() < pixels.size())
+      scratch.resize(pixels.size());
+    if (pool)
+      pool->parallelFor(height, pool->chunkSize(height),
+                        [&](int y0, int y1) { filterRows(fhoriz, scratch, y0, y1); });
+    else
+      filterRows(fhoriz, scratch, 0, height);
+
+    // do vertical
+    if (pool)
+      pool->parallelFor(width, pool->chunkSize(width),
+                        [&](int x0, int x1) { filterColumns(fvert, scratch, x0, x1); });
+    else
+      filterColumns(fvert, scratch, 0, width);
+  }
 
-    for (int y = 0; y < height; y++)
+  void FloatImage::filterRows(const std::vector<float> &fhoriz, std::vector<float> &r, int y0, int y1) const
+  {
+    for (int y = y0; y < y1; y++)
     {
       Gaussian::convolveSymmetricCentered(pixels, y * width, width, fhoriz, r, y * width);
     }
+  }
 
-    // do vertical
+  void FloatImage::filterColumns(const std::vector<float> &fvert, const std::vector<float> &r, int x0, int x1)
+  {
     std::vector<float> tmp(height);  // column before convolution
     std::vector<float> tmp2(height); // column after convolution
 
-    for (int x = 0; x < width; x++)
+    for (int x = x0; x < x1; x++)
     {
 
       // copy the column out for locality
@@ -56,12 +56,17 @@ namespace AprilTags
   }
 
   GLine2D GLine2D::lsqFitXYW(const std::vector<XYWeight> &xyweights)
+  {
+    return lsqFitXYW(xyweights.empty() ? NULL : &xyweights[0], xyweights.size());
+  }
+
+  GLine2D GLine2D::lsqFitXYW(const XYWeight *xyweights, size_t n_xyweights)
   {
     float Cxx = 0, Cyy = 0, Cxy = 0, Ex = 0, Ey = 0, mXX = 0, mYY = 0, mXY = 0, mX = 0, mY = 0;
     float n = 0;
 
     int idx = 0;
-    for (unsigned int i = 0; i < xyweights.size(); i++)
+    for (unsigned int i = 0; i < n_xyweights; i++)
     {
       float x = xyweights[i].x;
       float y = xyweights[i].y;
@@ -9,12 +9,17 @@ namespace AprilTags
 
 	GLineSegment2D GLineSegment2D::lsqFitXYW(const std::vector<XYWeight> &xyweight)
 	{
-		GLine2D gline = GLine2D::lsqFitXYW(xyweight);
+		return lsqFitXYW(xyweight.empty() ? NULL : &xyweight[0], xyweight.size());
+	}
+
+	GLineSegment2D GLineSegment2D::lsqFitXYW(const XYWeight *xyweight, size_t n)
+	{
+		GLine2D gline = GLine2D::lsqFitXYW(xyweight, n);
 		float maxcoord = -std::numeric_limits<float>::infinity();
 		float mincoord = std::numeric_limits<float>::infinity();
 		;
 
-		for (unsigned int i = 0; i < xyweight.size(); i++)
+		for (unsigned int i = 0; i < n; i++)
 		{
 			std::pair<float, float> p(xyweight[i].x, xyweight[i].y);
 			float coord = gline.getLineCoordinate(p);
@@ -4,7 +4,7 @@
 namespace AprilTags
 {
 
-  bool Gaussian::warned = false;
+  std::atomic<bool> Gaussian::warned(false);
 
   std::vector<float> Gaussian::makeGaussianFilter(float sigma, int n)
   {
@@ -55,8 +55,11 @@ namespace AprilTags
 
   void Quad::search(const FloatImage &fImage, std::vector<Segment *> &path,
                     Segment &parent, int depth, std::vector<Quad> &quads,
-                    const std::pair<float, float> &opticalCenter)
+                    const std::pair<float, float> &opticalCenter, size_t maxQuads)
   {
+    if (maxQuads > 0 && quads.size() >= maxQuads)
+      return;
+
     // cout << "Searching segment " << parent.getId() << ", depth=" << depth << ", #children=" << parent.children.size() << endl;
     // terminal depth occurs when we've found four segments.
     if (depth == 4)
@@ -167,7 +170,7 @@ namespace AprilTags
         continue;
       }
       path[depth + 1] = &child;
-      search(fImage, path, child, depth + 1, quads, opticalCenter);
+      search(fImage, path, child, depth + 1, quads, opticalCenter, maxQuads);
     }
   }
 
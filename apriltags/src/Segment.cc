@@ -20,6 +20,6 @@ namespace AprilTags
               << "(" << x1 << "," << y1 << ")" << std::endl;
   }
 
-  int Segment::idCounter = 0;
+  std::atomic<int> Segment::idCounter(0);
 
 } // namespace
@@ -22,15 +22,15 @@ namespace AprilTags
 {
 
   TagDetection::TagDetection()
-      : good(false), obsCode(), code(), id(), hammingDistance(), rotation(), p(),
-        cxy(), observedPerimeter(), homography(), hxy()
+      : good(false), obsCode(), code(), id(), family(), hammingDistance(), rotation(), p(),
+        pUndistorted(), cxy(), observedPerimeter(), homography(), hxy()
   {
     homography.setZero();
   }
 
   TagDetection::TagDetection(int _id)
-      : good(false), obsCode(), code(), id(_id), hammingDistance(), rotation(), p(),
-        cxy(), observedPerimeter(), homography(), hxy()
+      : good(false), obsCode(), code(), id(_id), family(), hammingDistance(), rotation(), p(),
+        pUndistorted(), cxy(), observedPerimeter(), homography(), hxy()
   {
     homography.setZero();
   }
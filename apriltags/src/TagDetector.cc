@@ -1,13 +1,14 @@
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <climits>
-#include <map>
 #include <vector>
 #include <iostream>
 
 #include <Eigen/Dense>
 
 #include "apriltags/Edge.h"
+#include "apriltags/EdgeRefiner.h"
 #include "apriltags/FloatImage.h"
 #include "apriltags/Gaussian.h"
 #include "apriltags/GrayModel.h"
@@ -19,6 +20,7 @@
 #include "apriltags/Quad.h"
 #include "apriltags/Segment.h"
 #include "apriltags/TagFamily.h"
+#include "apriltags/ThreadPool.h"
 #include "apriltags/UnionFindSimple.h"
 #include "apriltags/XYWeight.h"
 #include "apriltags/TagDetector.h"
@@ -35,23 +37,518 @@ using namespace std;
 namespace AprilTags
 {
 
-  std::vector<TagDetection> TagDetector::extractTags(const cv::Mat &image)
+  //! Orders (fit error, child) candidates of Step six, best fit first
+  static bool childFitCompare(const std::pair<float, Segment *> &a, const std::pair<float, Segment *> &b)
   {
+    return a.first < b.first;
+  }
 
-    // convert to internal AprilTags image (todo: slow, change internally to OpenCV)
-    int width = image.cols;
-    int height = image.rows;
-    AprilTags::FloatImage fimOrig(width, height);
-    int i = 0;
-    for (int y = 0; y < height; y++)
+  //! True if a deadline was given and has passed
+  static inline bool deadlineExpired(const TagDetector::Clock::time_point &deadline)
+  {
+    return deadline != TagDetector::Clock::time_point::max() && TagDetector::Clock::now() >= deadline;
+  }
+
+  //! Step five for one cluster: fit a line segment to its points; false if it is too short
+  /*! The line is fitted to fitPoints, the gradients are read at points (the same
+   *  pixels, in undistorted coordinates with a camera model).
+   */
+  static bool fitSegment(const XYWeight *points, const XYWeight *fitPoints, size_t nPoints, const FloatImage &fimTheta,
+                         const FloatImage &fimMag, const cv::Rect &window, Segment &seg)
+  {
+    GLineSegment2D gseg = GLineSegment2D::lsqFitXYW(fitPoints, nPoints);
+
+    // filter short lines
+    float length = MathUtil::distance2D(gseg.getP0(), gseg.getP1());
+    if (length < Segment::minimumLineLength)
+      return false;
+
+    float dy = gseg.getP1().second - gseg.getP0().second;
+    float dx = gseg.getP1().first - gseg.getP0().first;
+
+    float tmpTheta = std::atan2(dy, dx);
+
+    seg.setTheta(tmpTheta);
+    seg.setLength(length);
+
+    // We add an extra semantic to segments: the vector
+    // p1->p2 will have dark on the left, white on the right.
+    // To do this, we'll look at every gradient and each one
+    // will vote for which way they think the gradient should
+    // go. This is way more retentive than necessary: we
+    // could probably sample just one point!
+
+    float flip = 0, noflip = 0;
+    for (unsigned int i = 0; i < nPoints; i++)
     {
-      for (int x = 0; x < width; x++)
+      const XYWeight &xyw = points[i];
+
+      float theta = fimTheta.get((int)xyw.x - window.x, (int)xyw.y - window.y);
+      float mag = fimMag.get((int)xyw.x - window.x, (int)xyw.y - window.y);
+
+      // err *should* be +CV_PI/2 for the correct winding, but if we
+      // got the wrong winding, it'll be around -CV_PI/2.
+      float err = MathUtil::mod2pi(theta - seg.getTheta());
+
+      if (err < 0)
+        noflip += mag;
+      else
+        flip += mag;
+    }
+
+    if (flip > noflip)
+    {
+      float temp = seg.getTheta() + (float)CV_PI;
+      seg.setTheta(temp);
+    }
+
+    float dot = dx * std::cos(seg.getTheta()) + dy * std::sin(seg.getTheta());
+    if (dot > 0)
+    {
+      seg.setX0(gseg.getP1().first);
+      seg.setY0(gseg.getP1().second);
+      seg.setX1(gseg.getP0().first);
+      seg.setY1(gseg.getP0().second);
+    }
+    else
+    {
+      seg.setX0(gseg.getP0().first);
+      seg.setY0(gseg.getP0().second);
+      seg.setX1(gseg.getP1().first);
+      seg.setY1(gseg.getP1().second);
+    }
+    return true;
+  }
+
+  //! Step six for one segment: find the child segments that begin where the parent segment ends
+  /*! Candidates are scored by how far the corner lies from the segment ends,
+   *  relative to the parent length (lower is a better geometric fit). With
+   *  maxChildren > 0 only the best fitting ones are kept; returns true if any
+   *  were dropped.
+   */
+  static bool findChildren(Segment &parentseg, const Gridder<Segment> &gridder, size_t maxChildren,
+                           vector<std::pair<float, Segment *>> &candidates)
+  {
+    candidates.clear();
+
+    // compute length of the line segment
+    GLine2D parentLine(std::pair<float, float>(parentseg.getX0(), parentseg.getY0()),
+                       std::pair<float, float>(parentseg.getX1(), parentseg.getY1()));
+
+    Gridder<Segment>::iterator iter = gridder.find(parentseg.getX1(), parentseg.getY1(), 0.5f * parentseg.getLength());
+    while (iter.hasNext())
+    {
+      Segment &child = iter.next();
+      if (MathUtil::mod2pi(child.getTheta() - parentseg.getTheta()) > 0)
       {
-        fimOrig.set(x, y, image.data[i] / 255.);
-        i++;
+        continue;
       }
+
+      // compute intersection of points
+      GLine2D childLine(std::pair<float, float>(child.getX0(), child.getY0()),
+                        std::pair<float, float>(child.getX1(), child.getY1()));
+
+      std::pair<float, float> p = parentLine.intersectionWith(childLine);
+      if (p.first == -1)
+      {
+        continue;
+      }
+
+      float parentDist = MathUtil::distance2D(p, std::pair<float, float>(parentseg.getX1(), parentseg.getY1()));
+      float childDist = MathUtil::distance2D(p, std::pair<float, float>(child.getX0(), child.getY0()));
+
+      if (max(parentDist, childDist) > parentseg.getLength())
+      {
+        // cout << "intersection too far" << endl;
+        continue;
+      }
+
+      // everything's OK, this child is a reasonable successor.
+      candidates.push_back(std::make_pair(max(parentDist, childDist) / parentseg.getLength(), &child));
+    }
+
+    // keep only the best fitting successors; this bounds the branching factor of Step seven
+    bool capped = false;
+    if (maxChildren > 0 && candidates.size() > maxChildren)
+    {
+      std::stable_sort(candidates.begin(), candidates.end(), childFitCompare);
+      candidates.resize(maxChildren);
+      capped = true;
     }
-    std::pair<int, int> opticalCenter(width / 2, height / 2);
+
+    parentseg.children.reserve(candidates.size());
+    for (size_t k = 0; k < candidates.size(); k++)
+      parentseg.children.push_back(candidates[k].second);
+    return capped;
+  }
+
+  //! Map a quad found on the decimated window to full resolution and refine its corners on the image
+  static void upscaleQuad(Quad &quad, int decimate, const cv::Rect &window, const cv::Mat &image,
+                          const EdgeRefiner &refiner, std::vector<XYWeight> &samples,
+                          const std::pair<float, float> &opticalCenter)
+  {
+    // decimated pixel x averages the pixels [x * decimate, (x + 1) * decimate) of the window
+    std::vector<std::pair<float, float>> p(4);
+    for (int i = 0; i < 4; i++)
+      p[i] = std::make_pair(window.x + (quad.quadPoints[i].first + 0.5f) * decimate - 0.5f,
+                            window.y + (quad.quadPoints[i].second + 0.5f) * decimate - 0.5f);
+    refiner.refine(image, &p[0], samples); // keeps the scaled corners if refinement fails
+
+    Quad upscaled(p, opticalCenter);
+    upscaled.segments = quad.segments;
+    upscaled.observedPerimeter = quad.observedPerimeter * decimate;
+    quad = upscaled;
+  }
+
+  //! Gaussian kernel of the given sigma as used by TagDetector (empty if sigma is 0)
+  static std::vector<float> makeFilter(float sigma)
+  {
+    if (sigma <= 0)
+      return std::vector<float>();
+    int filtsz = ((int)max(3.0f, 3 * sigma)) | 1;
+    return Gaussian::makeGaussianFilter(sigma, filtsz);
+  }
+
+  TagDetector::TagDetector(const TagCodes &tagCodes, const size_t blackBorder, const TagDetectorOptions &options)
+      : thisTagFamily(tagCodes, blackBorder), tagFamilies(1, thisTagFamily), options(options),
+        sigma(0), segSigma(0.8f), filter(makeFilter(sigma)), segFilter(makeFilter(segSigma)),
+        threadPool(options.threadPool ? options.threadPool : std::make_shared<ThreadPool>(options.numThreads)),
+        idleWorkspaces(), workspaceMutex(), asyncExecutor(), executorMutex() {}
+
+  TagDetector::TagDetector(const std::vector<TagFamily> &families, const TagDetectorOptions &options)
+      : thisTagFamily(families.front()), tagFamilies(families), options(options),
+        sigma(0), segSigma(0.8f), filter(makeFilter(sigma)), segFilter(makeFilter(segSigma)),
+        threadPool(options.threadPool ? options.threadPool : std::make_shared<ThreadPool>(options.numThreads)),
+        idleWorkspaces(), workspaceMutex(), asyncExecutor(), executorMutex() {}
+
+  TagDetector::TagDetector(const TagDetector &other)
+      : thisTagFamily(other.thisTagFamily), tagFamilies(other.tagFamilies), options(other.options),
+        sigma(other.sigma), segSigma(other.segSigma), filter(other.filter), segFilter(other.segFilter),
+        threadPool(other.threadPool), idleWorkspaces(), workspaceMutex(), asyncExecutor(), executorMutex() {}
+
+  TagDetectorWorkspace *TagDetector::acquireWorkspace() const
+  {
+    std::lock_guard<std::mutex> lock(workspaceMutex);
+    if (idleWorkspaces.empty())
+      return new TagDetectorWorkspace();
+    TagDetectorWorkspace *ws = idleWorkspaces.back().release();
+    idleWorkspaces.pop_back();
+    return ws;
+  }
+
+  void TagDetector::releaseWorkspace(TagDetectorWorkspace *ws) const
+  {
+    std::unique_ptr<TagDetectorWorkspace> owned(ws);
+    std::lock_guard<std::mutex> lock(workspaceMutex);
+    idleWorkspaces.push_back(std::move(owned));
+  }
+
+  std::vector<TagDetection> TagDetector::extractTags(const cv::Mat &image) const
+  {
+    ExtractionStatus status;
+    return extractTags(image, status);
+  }
+
+  std::vector<TagDetection> TagDetector::extractTags(const cv::Mat &image, ExtractionStatus &status,
+                                                     const Clock::time_point &deadline) const
+  {
+    return extractTags(image, status, TagCallback(), deadline);
+  }
+
+  std::vector<TagDetection> TagDetector::extractTags(const cv::Mat &image, ExtractionStatus &status,
+                                                     const TagCallback &onTag, const Clock::time_point &deadline) const
+  {
+    // tags are decoded on several threads (and tiles) at once: hand them out one at a time,
+    // applying Step nine to the tags reported so far
+    std::mutex tagMutex;
+    std::vector<TagDetection> reported;
+    TagCallback serializedOnTag;
+    if (onTag)
+      serializedOnTag = [&](const TagDetection &detection) {
+        std::lock_guard<std::mutex> lock(tagMutex);
+        for (size_t i = 0; i < reported.size(); i++)
+        {
+          const TagDetection &other = reported[i];
+          if (detection.id == other.id && detection.family == other.family && detection.overlapsTooMuch(other) &&
+              (detection.hammingDistance > other.hammingDistance ||
+               (detection.hammingDistance == other.hammingDistance &&
+                detection.observedPerimeter <= other.observedPerimeter)))
+            return;
+        }
+        reported.push_back(detection);
+        onTag(detection);
+      };
+
+    status = ExtractionStatus();
+
+    std::vector<TagDetection> detections;
+    std::vector<cv::Rect> tiles;
+    if (tileWindows(image, tiles))
+    {
+      detectInTiles(image, tiles, NULL, status, deadline, serializedOnTag, detections);
+    }
+    else
+    {
+      WorkspaceLease lease(*this);
+      detectInWindow(image, cv::Rect(0, 0, image.cols, image.rows), cv::Mat(), lease.workspace(), status, deadline,
+                     serializedOnTag, detections);
+    }
+
+    std::vector<TagDetection> goodDetections;
+    mergeDetections(detections, goodDetections);
+    status.numDetections = goodDetections.size();
+    return goodDetections;
+  }
+
+  std::vector<TagDetection> TagDetector::extractTags(const cv::Mat &image, TagDetectorWorkspace &ws,
+                                                     ExtractionStatus &status, const Clock::time_point &deadline) const
+  {
+    status = ExtractionStatus();
+
+    std::vector<TagDetection> detections;
+    std::vector<cv::Rect> tiles;
+    if (tileWindows(image, tiles))
+      detectInTiles(image, tiles, &ws, status, deadline, TagCallback(), detections);
+    else
+      detectInWindow(image, cv::Rect(0, 0, image.cols, image.rows), cv::Mat(), ws, status, deadline, TagCallback(),
+                     detections);
+
+    std::vector<TagDetection> goodDetections;
+    mergeDetections(detections, goodDetections);
+    status.numDetections = goodDetections.size();
+    return goodDetections;
+  }
+
+  std::vector<TagDetection> TagDetector::extractTags(const cv::Mat &image, const std::vector<cv::Rect> &rois,
+                                                     ExtractionStatus &status, const Clock::time_point &deadline) const
+  {
+    status = ExtractionStatus();
+    WorkspaceLease lease(*this);
+
+    std::vector<cv::Rect> windows;
+    roiWindows(image, rois, windows);
+
+    std::vector<TagDetection> detections;
+    for (size_t w = 0; w < windows.size() && !status.partial; w++)
+      detectInWindow(image, windows[w], cv::Mat(), lease.workspace(), status, deadline, TagCallback(), detections);
+
+    std::vector<TagDetection> goodDetections;
+    mergeDetections(detections, goodDetections);
+    status.numDetections = goodDetections.size();
+    return goodDetections;
+  }
+
+  std::vector<TagDetection> TagDetector::extractTags(const cv::Mat &image, const cv::Mat &mask,
+                                                     ExtractionStatus &status, const Clock::time_point &deadline) const
+  {
+    status = ExtractionStatus();
+    WorkspaceLease lease(*this);
+
+    // every connected region of the mask is processed in its own window
+    cv::Mat labels, stats, centroids;
+    int nLabels = cv::connectedComponentsWithStats(mask, labels, stats, centroids, 8, CV_32S);
+    std::vector<cv::Rect> rois;
+    for (int l = 1; l < nLabels; l++) // label 0 is the background
+      rois.push_back(cv::Rect(stats.at<int>(l, cv::CC_STAT_LEFT), stats.at<int>(l, cv::CC_STAT_TOP),
+                              stats.at<int>(l, cv::CC_STAT_WIDTH), stats.at<int>(l, cv::CC_STAT_HEIGHT)));
+
+    std::vector<cv::Rect> windows;
+    roiWindows(image, rois, windows);
+
+    std::vector<TagDetection> detections;
+    for (size_t w = 0; w < windows.size() && !status.partial; w++)
+      detectInWindow(image, windows[w], mask, lease.workspace(), status, deadline, TagCallback(), detections);
+
+    std::vector<TagDetection> goodDetections;
+    mergeDetections(detections, goodDetections);
+    status.numDetections = goodDetections.size();
+    return goodDetections;
+  }
+
+  Executor &TagDetector::executor() const
+  {
+    std::lock_guard<std::mutex> lock(executorMutex);
+    if (!asyncExecutor)
+      asyncExecutor.reset(new Executor(options.asyncThreads));
+    return *asyncExecutor;
+  }
+
+  std::future<std::vector<TagDetection>> TagDetector::extractTagsAsync(const cv::Mat &image,
+                                                                       Executor::TaskId *outTaskId) const
+  {
+    // a cancelled task is destroyed without running, which breaks the promise of the future
+    std::shared_ptr<std::packaged_task<std::vector<TagDetection>()>> task =
+        std::make_shared<std::packaged_task<std::vector<TagDetection>()>>(
+            [this, image]() { return extractTags(image); });
+    std::future<std::vector<TagDetection>> result = task->get_future();
+
+    Executor::TaskId id = executor().submit([task]() { (*task)(); });
+    if (outTaskId)
+      *outTaskId = id;
+    return result;
+  }
+
+  Executor::TaskId TagDetector::extractTagsAsync(const cv::Mat &image, const DetectionsCallback &onComplete,
+                                                 const Executor::Task &onCancelled) const
+  {
+    return executor().submit(
+        [this, image, onComplete]() {
+          ExtractionStatus status;
+          std::vector<TagDetection> detections = extractTags(image, status);
+          onComplete(detections, status);
+        },
+        onCancelled);
+  }
+
+  int TagDetector::tileSizeForCache(size_t cacheBytes, int maxTagSize)
+  {
+    const int overlap = maxTagSize + 2 * roiMargin;
+    return max(2 * overlap, (int)std::sqrt((double)cacheBytes / bytesPerPixel));
+  }
+
+  bool TagDetector::tileWindows(const cv::Mat &image, std::vector<cv::Rect> &tiles) const
+  {
+    const int overlap = tileOverlap();
+    // a tile must advance by at least one pixel past its overlap
+    const int tileSize = max(options.tileSize, overlap + 1);
+    if (options.tileSize <= 0 || (image.cols <= tileSize && image.rows <= tileSize))
+      return false;
+
+    // tile origins along one axis; the last tile is aligned with the image end
+    std::vector<int> xs, ys;
+    for (int x = 0;; x += tileSize - overlap)
+    {
+      if (x + tileSize >= image.cols)
+      {
+        xs.push_back(max(0, image.cols - tileSize));
+        break;
+      }
+      xs.push_back(x);
+    }
+    for (int y = 0;; y += tileSize - overlap)
+    {
+      if (y + tileSize >= image.rows)
+      {
+        ys.push_back(max(0, image.rows - tileSize));
+        break;
+      }
+      ys.push_back(y);
+    }
+
+    tiles.clear();
+    for (size_t j = 0; j < ys.size(); j++)
+      for (size_t i = 0; i < xs.size(); i++)
+        tiles.push_back(cv::Rect(xs[i], ys[j], min(tileSize, image.cols), min(tileSize, image.rows)));
+    return true;
+  }
+
+  void TagDetector::detectInTiles(const cv::Mat &image, const std::vector<cv::Rect> &tiles, TagDetectorWorkspace *ws,
+                                  ExtractionStatus &status, const Clock::time_point &deadline,
+                                  const TagCallback &onTag, std::vector<TagDetection> &detections) const
+  {
+    if (ws)
+    {
+      for (size_t t = 0; t < tiles.size() && !status.partial; t++)
+        detectInWindow(image, tiles[t], cv::Mat(), *ws, status, deadline, onTag, detections);
+      return;
+    }
+
+    // every tile reports into its own slot, which are then collected in tile order
+    std::vector<ExtractionStatus> tileStatus(tiles.size());
+    std::vector<std::vector<TagDetection>> tileDetections(tiles.size());
+    threadPool->parallelFor((int)tiles.size(), 1, [&](int t0, int t1) {
+      for (int t = t0; t < t1; t++)
+      {
+        WorkspaceLease lease(*this);
+        detectInWindow(image, tiles[t], cv::Mat(), lease.workspace(), tileStatus[t], deadline, onTag,
+                       tileDetections[t]);
+      }
+    });
+
+    for (size_t t = 0; t < tiles.size(); t++)
+    {
+      status.add(tileStatus[t]);
+      detections.insert(detections.end(), tileDetections[t].begin(), tileDetections[t].end());
+    }
+  }
+
+  void TagDetector::roiWindows(const cv::Mat &image, const std::vector<cv::Rect> &rois, std::vector<cv::Rect> &windows)
+  {
+    const cv::Rect frame(0, 0, image.cols, image.rows);
+
+    windows.clear();
+    for (size_t r = 0; r < rois.size(); r++)
+    {
+      cv::Rect window(rois[r].x - roiMargin, rois[r].y - roiMargin,
+                      rois[r].width + 2 * roiMargin, rois[r].height + 2 * roiMargin);
+      window &= frame;
+      if (window.width >= 3 && window.height >= 3)
+        windows.push_back(window);
+    }
+
+    // Merge overlapping windows, but only if their bounding box is not larger
+    // than the two windows together. Otherwise the overlap is processed twice
+    // and Step nine removes the duplicate detections.
+    bool merged = true;
+    while (merged)
+    {
+      merged = false;
+      for (size_t a = 0; a < windows.size() && !merged; a++)
+      {
+        for (size_t b = a + 1; b < windows.size() && !merged; b++)
+        {
+          cv::Rect both = windows[a] | windows[b];
+          if ((windows[a] & windows[b]).area() > 0 && both.area() <= windows[a].area() + windows[b].area())
+          {
+            windows[a] = both;
+            windows.erase(windows.begin() + b);
+            merged = true;
+          }
+        }
+      }
+    }
+  }
+
+  void TagDetector::detectInWindow(const cv::Mat &image, const cv::Rect &window, const cv::Mat &mask,
+                                   TagDetectorWorkspace &ws, ExtractionStatus &status, const Clock::time_point &deadline,
+                                   const TagCallback &onTag, std::vector<TagDetection> &detections) const
+  {
+    // convert to internal AprilTags image (todo: slow, change internally to OpenCV)
+    int width = window.width;
+    int height = window.height;
+    ThreadPool &pool = *threadPool;
+    FloatImage &fimOrig = ws.fimOrig;
+    fimOrig.resize(width, height);
+    pool.parallelFor(height, pool.chunkSize(height), [&](int y0, int y1) {
+      for (int y = y0; y < y1; y++)
+      {
+        const uchar *row = image.ptr<uchar>(window.y + y) + window.x;
+        for (int x = 0; x < width; x++)
+          fimOrig.set(x, y, row[x] / 255.);
+      }
+    });
+    // From Step four on, everything is in image coordinates: line fits, quads
+    // and homographies then come out exactly as in a full-frame run.
+    std::pair<int, int> opticalCenter(image.cols / 2, image.rows / 2);
+
+    // With decimation, Steps two to seven run on the box-averaged image, in its own
+    // coordinates (segWindow). The quads are mapped back to full resolution and
+    // refined on the image before Step eight decodes them.
+    const int decimate = std::max(1, options.decimate);
+    const FloatImage *detectImage = &fimOrig;
+    cv::Rect segWindow = window;
+    std::pair<float, float> segOpticalCenter(opticalCenter.first, opticalCenter.second);
+    if (decimate > 1)
+    {
+      ws.fimDecimated.decimateAvg(fimOrig, decimate, &pool);
+      detectImage = &ws.fimDecimated;
+      segWindow = cv::Rect(0, 0, ws.fimDecimated.getWidth(), ws.fimDecimated.getHeight());
+      segOpticalCenter = std::make_pair((opticalCenter.first - window.x + 0.5f) / decimate - 0.5f,
+                                        (opticalCenter.second - window.y + 0.5f) / decimate - 0.5f);
+      width = segWindow.width;
+      height = segWindow.height;
+    }
+    const int rowChunk = pool.chunkSize(height);
 
 #ifdef DEBUG_APRIL
 #if 0
@@ -100,32 +597,19 @@ namespace AprilTags
     //================================================================
     // Step one: preprocess image (convert to grayscale) and low pass if necessary
 
-    FloatImage fim = fimOrig;
-
-    //! Gaussian smoothing kernel applied to image (0 == no filter).
-    /*! Used when sampling bits. Filtering is a good idea in cases
-     * where A) a cheap camera is introducing artifical sharpening, B)
-     * the bayer pattern is creating artifcats, C) the sensor is very
-     * noisy and/or has hot/cold pixels. However, filtering makes it
-     * harder to decode very small tags. Reasonable values are 0, or
-     * [0.8, 1.5].
-     */
-    float sigma = 0;
-
-    //! Gaussian smoothing kernel applied to image (0 == no filter).
-    /*! Used when detecting the outline of the box. It is almost always
-     * useful to have some filtering, since the loss of small details
-     * won't hurt. Recommended value = 0.8. The case where sigma ==
-     * segsigma has been optimized to avoid a redundant filter
-     * operation.
-     */
-    float segSigma = 0.8f;
-
+    // without filtering, bits are sampled from the original image and no copy is needed
     if (sigma > 0)
     {
-      int filtsz = ((int)max(3.0f, 3 * sigma)) | 1;
-      std::vector<float> filt = Gaussian::makeGaussianFilter(sigma, filtsz);
-      fim.filterFactoredCentered(filt, filt);
+      ws.fim = fimOrig;
+      ws.fim.filterFactoredCentered(filter, filter, ws.filterScratch, &pool);
+    }
+    const FloatImage &fim = (sigma > 0) ? ws.fim : fimOrig;
+
+    // Before Step eight there is nothing decoded yet, so an expired deadline yields no tags.
+    if (deadlineExpired(deadline))
+    {
+      status.partial = true;
+      return;
     }
 
     //================================================================
@@ -134,49 +618,72 @@ namespace AprilTags
     // break up segments, causing us to miss Quads. It is useful to do a Gaussian
     // low pass on this step even if we don't want it for encoding.
 
-    FloatImage fimSeg;
+    const FloatImage *segImage = detectImage;
     if (segSigma > 0)
     {
-      if (segSigma == sigma)
+      if (segSigma == sigma && decimate == 1)
       {
-        fimSeg = fim;
+        segImage = &fim;
       }
       else
       {
         // blur anew
-        int filtsz = ((int)max(3.0f, 3 * segSigma)) | 1;
-        std::vector<float> filt = Gaussian::makeGaussianFilter(segSigma, filtsz);
-        fimSeg = fimOrig;
-        fimSeg.filterFactoredCentered(filt, filt);
+        ws.fimSeg = *detectImage;
+        ws.fimSeg.filterFactoredCentered(segFilter, segFilter, ws.filterScratch, &pool);
+        segImage = &ws.fimSeg;
       }
     }
-    else
-    {
-      fimSeg = fimOrig;
-    }
+    const FloatImage &fimSeg = *segImage;
 
-    FloatImage fimTheta(fimSeg.getWidth(), fimSeg.getHeight());
-    FloatImage fimMag(fimSeg.getWidth(), fimSeg.getHeight());
+    FloatImage &fimTheta = ws.fimTheta;
+    FloatImage &fimMag = ws.fimMag;
+    fimTheta.resize(width, height);
+    fimMag.resize(width, height);
 
-#pragma omp parallel for
-    for (int y = 1; y < fimSeg.getHeight() - 1; y++)
-    {
-      for (int x = 1; x < fimSeg.getWidth() - 1; x++)
+    pool.parallelFor(height, rowChunk, [&](int y0, int y1) {
+      for (int y = y0; y < y1; y++)
       {
-        float Ix = fimSeg.get(x + 1, y) - fimSeg.get(x - 1, y);
-        float Iy = fimSeg.get(x, y + 1) - fimSeg.get(x, y - 1);
+        // The buffers hold the previous frame: clear the image border, which gets no gradient
+        if (y == 0 || y == height - 1)
+        {
+          for (int x = 0; x < width; x++)
+          {
+            fimTheta.set(x, y, 0);
+            fimMag.set(x, y, 0);
+          }
+          continue;
+        }
+        fimTheta.set(0, y, 0);
+        fimMag.set(0, y, 0);
+        fimTheta.set(width - 1, y, 0);
+        fimMag.set(width - 1, y, 0);
+
+        // pixels outside of the mask get no gradient, hence no edges and no clusters
+        const uchar *maskRow = mask.empty() ? NULL : mask.ptr<uchar>(window.y + y * decimate) + window.x;
+        for (int x = 1; x < width - 1; x++)
+        {
+          if (maskRow && !maskRow[x * decimate])
+          {
+            fimTheta.set(x, y, 0);
+            fimMag.set(x, y, 0);
+            continue;
+          }
 
-        float mag = Ix * Ix + Iy * Iy;
+          float Ix = fimSeg.get(x + 1, y) - fimSeg.get(x - 1, y);
+          float Iy = fimSeg.get(x, y + 1) - fimSeg.get(x, y - 1);
+
+          float mag = Ix * Ix + Iy * Iy;
 #if 0 // kaess: fast version, but maybe less accurate?
-      float theta = MathUtil::fast_atan2(Iy, Ix);
+        float theta = MathUtil::fast_atan2(Iy, Ix);
 #else
-        float theta = atan2(Iy, Ix);
+          float theta = atan2(Iy, Ix);
 #endif
 
-        fimTheta.set(x, y, theta);
-        fimMag.set(x, y, mag);
+          fimTheta.set(x, y, theta);
+          fimMag.set(x, y, mag);
+        }
       }
-    }
+    });
 
 #ifdef DEBUG_APRIL
     int height_ = fimSeg.getHeight();
@@ -205,29 +712,47 @@ namespace AprilTags
     }
 #endif
 
+    if (deadlineExpired(deadline))
+    {
+      status.partial = true;
+      return;
+    }
+
     //================================================================
     // Step three. Extract edges by grouping pixels with similar
     // thetas together. This is a greedy algorithm: we start with
     // the most similar pixels.  We use 4-connectivity.
-    UnionFindSimple uf(fimSeg.getWidth() * fimSeg.getHeight());
-
-    vector<Edge> edges(width * height * 4);
-    size_t nEdges = 0;
+    UnionFindSimple &uf = ws.uf;
+    uf.reset(width * height);
+
+    // Edge costs are small integers (0..WEIGHT_SCALE), so instead of sorting
+    // the edges we count them per cost first and then write each one straight
+    // to its place. Edges of equal cost keep their raster order, exactly as
+    // with a stable sort. Rows are processed in bands, each with its own
+    // histogram, so that both passes can run in parallel.
+    const int numCosts = Edge::WEIGHT_SCALE + 1;
+    const int edgeRows = height - 1;
+    const int bandRows = pool.chunkSize(edgeRows);
+    const int numBands = (edgeRows + bandRows - 1) / bandRows;
+
+    vector<signed char> &edgeCosts = ws.edgeCosts;
+    vector<size_t> &costHistogram = ws.costHistogram; // numCosts entries per band
+    edgeCosts.resize(width * height * 4);
+    costHistogram.assign(numBands * numCosts, 0);
 
     // Bounds on the thetas assigned to this group. Note that because
     // theta is periodic, these are defined such that the average
     // value is contained *within* the interval.
-    { // limit scope of storage
-      /* Previously all this was on the stack, but this is 1.2MB for 320x240 images
-       * That's already a problem for OS X (default 512KB thread stack size),
-       * could be a problem elsewhere for bigger images... so store on heap */
-      vector<float> storage(width * height * 4); // do all the memory in one big block, exception safe
-      float *tmin = &storage[width * height * 0];
-      float *tmax = &storage[width * height * 1];
-      float *mmin = &storage[width * height * 2];
-      float *mmax = &storage[width * height * 3];
-
-      for (int y = 0; y + 1 < height; y++)
+    vector<float> &storage = ws.storage; // do all the memory in one big block
+    storage.resize(width * height * 4);
+    float *tmin = &storage[width * height * 0];
+    float *tmax = &storage[width * height * 1];
+    float *mmin = &storage[width * height * 2];
+    float *mmax = &storage[width * height * 3];
+
+    pool.parallelFor(edgeRows, bandRows, [&](int y0, int y1) {
+      size_t *histogram = &costHistogram[(y0 / bandRows) * numCosts];
+      for (int y = y0; y < y1; y++)
       {
         for (int x = 0; x + 1 < width; x++)
         {
@@ -242,116 +767,214 @@ namespace AprilTags
           tmin[y * width + x] = theta0;
           tmax[y * width + x] = theta0;
 
-          // Calculates then adds edges to 'vector<Edge> edges'
-          Edge::calcEdges(theta0, x, y, fimTheta, fimMag, edges, nEdges);
+          int costs[4];
+          Edge::calcEdgeCosts(theta0, x, y, fimTheta, fimMag, costs);
+          for (int k = 0; k < 4; k++)
+          {
+            edgeCosts[(y * width + x) * 4 + k] = (signed char)costs[k];
+            if (costs[k] >= 0)
+              histogram[costs[k]]++;
+          }
 
           // XXX Would 8 connectivity help for rotated tags?
           // Probably not much, so long as input filtering hasn't been disabled.
         }
       }
+    });
+
+    // turn the counts into the index of the first edge of each (cost, band)
+    size_t nEdges = 0;
+    for (int c = 0; c < numCosts; c++)
+    {
+      for (int b = 0; b < numBands; b++)
+      {
+        size_t count = costHistogram[b * numCosts + c];
+        costHistogram[b * numCosts + c] = nEdges;
+        nEdges += count;
+      }
+    }
 
+    vector<Edge> &edges = ws.edges;
+    if (edges.size() < nEdges)
       edges.resize(nEdges);
-      std::stable_sort(edges.begin(), edges.end());
-      Edge::mergeEdges(edges, uf, tmin, tmax, mmin, mmax);
+
+    pool.parallelFor(edgeRows, bandRows, [&](int y0, int y1) {
+      size_t *next = &costHistogram[(y0 / bandRows) * numCosts];
+      for (int y = y0; y < y1; y++)
+      {
+        for (int x = 0; x + 1 < width; x++)
+        {
+          if (fimMag.get(x, y) < Edge::minMag)
+            continue;
+
+          // right, down, down-right and down-left neighbor, see Edge::calcEdgeCosts
+          const int thisPixel = y * width + x;
+          const int neighbors[4] = {thisPixel + 1, thisPixel + width, thisPixel + width + 1, thisPixel + width - 1};
+          for (int k = 0; k < 4; k++)
+          {
+            int cost = edgeCosts[thisPixel * 4 + k];
+            if (cost < 0)
+              continue;
+            Edge &edge = edges[next[cost]++];
+            edge.cost = cost;
+            edge.pixelIdxA = thisPixel;
+            edge.pixelIdxB = neighbors[k];
+          }
+        }
+      }
+    });
+
+    Edge::mergeEdges(nEdges > 0 ? &edges[0] : NULL, nEdges, uf, tmin, tmax, mmin, mmax);
+
+    if (deadlineExpired(deadline))
+    {
+      status.partial = true;
+      return;
     }
 
     //================================================================
     // Step four: Loop over the pixels again, collecting statistics for each cluster.
     // We will soon fit lines (segments) to these points.
 
-    map<int, vector<XYWeight>> clusters;
-    for (int y = 0; y + 1 < fimSeg.getHeight(); y++)
+    // Look up the cluster of every pixel (in parallel, the union-find is only read
+    // from now on). Then count the points of each cluster and store all points
+    // back to back, grouped by cluster. Clusters are ordered by representative.
+    vector<int> &pixelReps = ws.pixelReps; // -1 if the pixel's set is too small
+    pixelReps.resize(width * height);
+    pool.parallelFor(edgeRows, bandRows, [&](int y0, int y1) {
+      for (int y = y0; y < y1; y++)
+      {
+        for (int x = 0; x + 1 < width; x++)
+        {
+          int rep = uf.findRepresentative(y * width + x);
+          pixelReps[y * width + x] = (uf.getRepresentativeSetSize(rep) < Segment::minimumSegmentSize) ? -1 : rep;
+        }
+      }
+    });
+
+    vector<int> &clusterIndex = ws.clusterIndex;
+    vector<std::pair<int, int>> &clusters = ws.clusters; // (rep, number of points)
+    clusterIndex.assign(width * height, -1);
+    clusters.clear();
+    for (int y = 0; y + 1 < height; y++)
     {
-      for (int x = 0; x + 1 < fimSeg.getWidth(); x++)
+      for (int x = 0; x + 1 < width; x++)
       {
-        if (uf.getSetSize(y * fimSeg.getWidth() + x) < Segment::minimumSegmentSize)
+        int rep = pixelReps[y * width + x];
+        if (rep < 0)
           continue;
 
-        int rep = (int)uf.getRepresentative(y * fimSeg.getWidth() + x);
-
-        map<int, vector<XYWeight>>::iterator it = clusters.find(rep);
-        if (it == clusters.end())
+        if (clusterIndex[rep] < 0)
         {
-          clusters[rep] = vector<XYWeight>();
-          it = clusters.find(rep);
+          clusterIndex[rep] = (int)clusters.size();
+          clusters.push_back(std::make_pair(rep, 0));
         }
-        vector<XYWeight> &points = it->second;
-        points.push_back(XYWeight(x, y, fimMag.get(x, y)));
+        clusters[clusterIndex[rep]].second++;
       }
     }
+    status.numClusters += clusters.size();
 
-    //================================================================
-    // Step five: Loop over the clusters, fitting lines (which we call Segments).
-    std::vector<Segment> segments; // used in Step six
-    std::map<int, std::vector<XYWeight>>::const_iterator clustersItr;
-    for (clustersItr = clusters.begin(); clustersItr != clusters.end(); clustersItr++)
+    // Cluttered scenes (foliage, cables, noise) can produce huge numbers of
+    // clusters. Keep only the largest ones, since tag borders form long edges.
+    if (options.maxClusters > 0 && clusters.size() > options.maxClusters)
     {
-      std::vector<XYWeight> points = clustersItr->second;
-      GLineSegment2D gseg = GLineSegment2D::lsqFitXYW(points);
-
-      // filter short lines
-      float length = MathUtil::distance2D(gseg.getP0(), gseg.getP1());
-      if (length < Segment::minimumLineLength)
-        continue;
-
-      Segment seg;
-      float dy = gseg.getP1().second - gseg.getP0().second;
-      float dx = gseg.getP1().first - gseg.getP0().first;
-
-      float tmpTheta = std::atan2(dy, dx);
-
-      seg.setTheta(tmpTheta);
-      seg.setLength(length);
+      vector<std::pair<int, int>> &bySize = ws.clustersBySize; // (-size, rep), so that ties are broken by rep
+      bySize.clear();
+      for (size_t k = 0; k < clusters.size(); k++)
+        bySize.push_back(std::make_pair(-clusters[k].second, clusters[k].first));
+      std::nth_element(bySize.begin(), bySize.begin() + options.maxClusters, bySize.end());
+      for (size_t k = options.maxClusters; k < bySize.size(); k++)
+        clusterIndex[bySize[k].second] = -1;
+      clusters.clear();
+      for (size_t k = 0; k < options.maxClusters; k++)
+        clusters.push_back(std::make_pair(bySize[k].second, -bySize[k].first));
+      status.clustersCapped = true;
+    }
 
-      // We add an extra semantic to segments: the vector
-      // p1->p2 will have dark on the left, white on the right.
-      // To do this, we'll look at every gradient and each one
-      // will vote for which way they think the gradient should
-      // go. This is way more retentive than necessary: we
-      // could probably sample just one point!
+    std::sort(clusters.begin(), clusters.end());
+    vector<size_t> &clusterOffsets = ws.clusterOffsets; // clusterOffsets[k]: first point of cluster k
+    clusterOffsets.resize(clusters.size() + 1);
+    clusterOffsets[0] = 0;
+    for (size_t k = 0; k < clusters.size(); k++)
+    {
+      clusterIndex[clusters[k].first] = (int)k;
+      clusterOffsets[k + 1] = clusterOffsets[k] + clusters[k].second;
+    }
 
-      float flip = 0, noflip = 0;
-      for (unsigned int i = 0; i < points.size(); i++)
+    vector<XYWeight> &clusterPoints = ws.clusterPoints;
+    if (clusterPoints.size() < clusterOffsets.back())
+      clusterPoints.resize(clusterOffsets.back());
+    for (int y = 0; y + 1 < height; y++)
+    {
+      for (int x = 0; x + 1 < width; x++)
       {
-        XYWeight xyw = points[i];
-
-        float theta = fimTheta.get((int)xyw.x, (int)xyw.y);
-        float mag = fimMag.get((int)xyw.x, (int)xyw.y);
-
-        // err *should* be +CV_PI/2 for the correct winding, but if we
-        // got the wrong winding, it'll be around -CV_PI/2.
-        float err = MathUtil::mod2pi(theta - seg.getTheta());
-
-        if (err < 0)
-          noflip += mag;
-        else
-          flip += mag;
-      }
+        int rep = pixelReps[y * width + x];
+        if (rep < 0 || clusterIndex[rep] < 0)
+          continue;
 
-      if (flip > noflip)
-      {
-        float temp = seg.getTheta() + (float)CV_PI;
-        seg.setTheta(temp);
+        int k = clusterIndex[rep];
+        clusterPoints[clusterOffsets[k]++] = XYWeight(x + segWindow.x, y + segWindow.y, fimMag.get(x, y));
       }
+    }
+    // the fill above advanced each offset to the start of the next cluster
+    for (size_t k = clusters.size(); k > 0; k--)
+      clusterOffsets[k] = clusterOffsets[k - 1];
+    clusterOffsets[0] = 0;
+
+    // With a camera model, lines are fitted to the undistorted edge points. Pixel x of
+    // segWindow covers image pixels [x * decimate, (x + 1) * decimate) of the window.
+    const XYWeight *fitPoints = clusterPoints.data();
+    if (options.camera.hasDistortion())
+    {
+      vector<XYWeight> &undistorted = ws.clusterPointsUndistorted;
+      const int numPoints = (int)clusterOffsets.back();
+      if (undistorted.size() < (size_t)numPoints)
+        undistorted.resize(numPoints);
+      pool.parallelFor(numPoints, pool.chunkSize(numPoints), [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++)
+        {
+          const XYWeight &xyw = clusterPoints[i];
+          std::pair<float, float> u = options.camera.undistort(
+              std::make_pair(window.x + (xyw.x - segWindow.x + 0.5f) * decimate - 0.5f,
+                             window.y + (xyw.y - segWindow.y + 0.5f) * decimate - 0.5f));
+          undistorted[i] = XYWeight((u.first - window.x + 0.5f) / decimate - 0.5f + segWindow.x,
+                                    (u.second - window.y + 0.5f) / decimate - 0.5f + segWindow.y, xyw.weight);
+        }
+      });
+      fitPoints = undistorted.data();
+    }
 
-      float dot = dx * std::cos(seg.getTheta()) + dy * std::sin(seg.getTheta());
-      if (dot > 0)
-      {
-        seg.setX0(gseg.getP1().first);
-        seg.setY0(gseg.getP1().second);
-        seg.setX1(gseg.getP0().first);
-        seg.setY1(gseg.getP0().second);
-      }
-      else
-      {
-        seg.setX0(gseg.getP0().first);
-        seg.setY0(gseg.getP0().second);
-        seg.setX1(gseg.getP1().first);
-        seg.setY1(gseg.getP1().second);
-      }
+    if (deadlineExpired(deadline))
+    {
+      status.partial = true;
+      return;
+    }
 
-      segments.push_back(seg);
+    //================================================================
+    // Step five: Loop over the clusters, fitting lines (which we call Segments).
+    // Every cluster gets a slot, the clusters without a segment are removed afterwards.
+    std::vector<Segment> &segments = ws.segments; // used in Step six
+    vector<char> &fitted = ws.segmentFitted;
+    const int numClusters = (int)clusters.size();
+    segments.clear();
+    segments.resize(numClusters);
+    fitted.assign(numClusters, 0);
+    pool.parallelFor(numClusters, pool.chunkSize(numClusters), [&](int k0, int k1) {
+      for (int k = k0; k < k1; k++)
+        fitted[k] = fitSegment(&clusterPoints[clusterOffsets[k]], fitPoints + clusterOffsets[k],
+                               clusterOffsets[k + 1] - clusterOffsets[k], fimTheta, fimMag, segWindow, segments[k]);
+    });
+
+    size_t numSegments = 0;
+    for (int k = 0; k < numClusters; k++)
+    {
+      if (!fitted[k])
+        continue;
+      if (numSegments != (size_t)k)
+        segments[numSegments] = segments[k];
+      numSegments++;
     }
+    segments.erase(segments.begin() + numSegments, segments.end());
 
 #ifdef DEBUG_APRIL
 #if 0
@@ -367,10 +990,38 @@ namespace AprilTags
 #endif
 #endif
 
+    if (deadlineExpired(deadline))
+    {
+      status.partial = true;
+      return;
+    }
+
     // Step six: For each segment, find segments that begin where this segment ends.
     // (We will chain segments together next...) The gridder accelerates the search by
     // building (essentially) a 2D hash table.
-    Gridder<Segment> gridder(0, 0, width, height, 10);
+    // cells are aligned with those of a full-frame gridder, which keeps the child order identical
+    int gridX0 = segWindow.x - segWindow.x % 10;
+    int gridY0 = segWindow.y - segWindow.y % 10;
+    int gridX1 = segWindow.x + width;
+    int gridY1 = segWindow.y + height;
+    if (options.camera.hasDistortion())
+    {
+      // undistorted segments may reach beyond the window; segments far outside of it
+      // (near the edge of a fisheye image) are left out rather than growing the grid
+      for (size_t i = 0; i < segments.size(); i++)
+      {
+        gridX0 = std::min(gridX0, (int)std::floor(std::min(segments[i].getX0(), segments[i].getX1()) / 10) * 10);
+        gridY0 = std::min(gridY0, (int)std::floor(std::min(segments[i].getY0(), segments[i].getY1()) / 10) * 10);
+        gridX1 = std::max(gridX1, (int)std::ceil(std::max(segments[i].getX0(), segments[i].getX1())) + 1);
+        gridY1 = std::max(gridY1, (int)std::ceil(std::max(segments[i].getY0(), segments[i].getY1())) + 1);
+      }
+      gridX0 = std::max(gridX0, (segWindow.x - width) / 10 * 10);
+      gridY0 = std::max(gridY0, (segWindow.y - height) / 10 * 10);
+      gridX1 = std::min(gridX1, segWindow.x + 2 * width);
+      gridY1 = std::min(gridY1, segWindow.y + 2 * height);
+    }
+    Gridder<Segment> &gridder = ws.gridder;
+    gridder.reset(gridX0, gridY0, gridX1, gridY1, 10);
 
     // add every segment to the hash table according to the position of the segment's
     // first point. Remember that the first point has a specific meaning due to our
@@ -380,59 +1031,99 @@ namespace AprilTags
       gridder.add(segments[i].getX0(), segments[i].getY0(), &segments[i]);
     }
 
-    // Now, find child segments that begin where each parent segment ends.
-    for (unsigned i = 0; i < segments.size(); i++)
-    {
-      Segment &parentseg = segments[i];
-
-      // compute length of the line segment
-      GLine2D parentLine(std::pair<float, float>(parentseg.getX0(), parentseg.getY0()),
-                         std::pair<float, float>(parentseg.getX1(), parentseg.getY1()));
+    status.numSegments += segments.size();
 
-      Gridder<Segment>::iterator iter = gridder.find(parentseg.getX1(), parentseg.getY1(), 0.5f * parentseg.getLength());
-      while (iter.hasNext())
+    // Now, find child segments that begin where each parent segment ends.
+    // The gridder is only read, so the parents are processed in parallel.
+    std::atomic<bool> childrenCapped(false);
+    pool.parallelFor((int)segments.size(), pool.chunkSize((int)segments.size()), [&](int i0, int i1) {
+      vector<std::pair<float, Segment *>> candidates;
+      for (int i = i0; i < i1; i++)
       {
-        Segment &child = iter.next();
-        if (MathUtil::mod2pi(child.getTheta() - parentseg.getTheta()) > 0)
-        {
-          continue;
-        }
+        if (findChildren(segments[i], gridder, options.maxChildrenPerSegment, candidates))
+          childrenCapped = true;
+      }
+    });
+    if (childrenCapped)
+      status.childrenCapped = true;
 
-        // compute intersection of points
-        GLine2D childLine(std::pair<float, float>(child.getX0(), child.getY0()),
-                          std::pair<float, float>(child.getX1(), child.getY1()));
+    //================================================================
+    // Step seven: Search all connected segments to see if any form a loop of length 4.
+    // Add those to the quads list.
+    vector<Quad> &quads = ws.quads;
+    quads.clear();
 
-        std::pair<float, float> p = parentLine.intersectionWith(childLine);
-        if (p.first == -1)
+    if (options.maxQuads == 0)
+    {
+      // Searches starting at different segments are independent. Each chunk of
+      // segments collects its own quads; appending them chunk by chunk gives
+      // the same order as a search over all segments in turn.
+      const int numSearch = (int)segments.size();
+      const int searchChunk = pool.chunkSize(numSearch);
+      vector<vector<Quad>> &chunkQuads = ws.chunkQuads;
+      chunkQuads.resize((numSearch + searchChunk - 1) / searchChunk);
+      for (size_t c = 0; c < chunkQuads.size(); c++)
+        chunkQuads[c].clear();
+
+      std::atomic<bool> expired(false);
+      pool.parallelFor(numSearch, searchChunk, [&](int i0, int i1) {
+        vector<Segment *> tmp(5);
+        for (int i = i0; i < i1 && !expired; i++)
         {
-          continue;
+          if (deadlineExpired(deadline))
+          {
+            expired = true;
+            break;
+          }
+          tmp[0] = &segments[i];
+          Quad::search(*detectImage, tmp, segments[i], 0, chunkQuads[i0 / searchChunk], segOpticalCenter);
         }
+      });
+      if (expired)
+      {
+        status.partial = true;
+        return;
+      }
 
-        float parentDist = MathUtil::distance2D(p, std::pair<float, float>(parentseg.getX1(), parentseg.getY1()));
-        float childDist = MathUtil::distance2D(p, std::pair<float, float>(child.getX0(), child.getY0()));
-
-        if (max(parentDist, childDist) > parentseg.getLength())
+      for (size_t c = 0; c < chunkQuads.size(); c++)
+        quads.insert(quads.end(), chunkQuads[c].begin(), chunkQuads[c].end());
+    }
+    else
+    {
+      // With a quad budget, search from the longest segments first: they belong
+      // to the largest (best resolved) tags, which are the ones worth keeping.
+      // The search stops at the budget, which depends on the order: it runs serially.
+      vector<std::pair<float, unsigned int>> &searchOrder = ws.searchOrder; // (-length, index)
+      searchOrder.resize(segments.size());
+      for (unsigned int i = 0; i < segments.size(); i++)
+        searchOrder[i] = std::make_pair(-segments[i].getLength(), i);
+      std::sort(searchOrder.begin(), searchOrder.end());
+
+      // search for one quad more than allowed, so that we can tell whether the cap triggered
+      const size_t quadLimit = options.maxQuads + 1;
+
+      vector<Segment *> tmp(5);
+      for (unsigned int k = 0; k < searchOrder.size(); k++)
+      {
+        if (quads.size() >= quadLimit)
+          break;
+        if (deadlineExpired(deadline))
         {
-          // cout << "intersection too far" << endl;
-          continue;
+          status.partial = true;
+          return;
         }
-
-        // everything's OK, this child is a reasonable successor.
-        parentseg.children.push_back(&child);
+        unsigned int i = searchOrder[k].second;
+        tmp[0] = &segments[i];
+        Quad::search(*detectImage, tmp, segments[i], 0, quads, segOpticalCenter, quadLimit);
       }
-    }
 
-    //================================================================
-    // Step seven: Search all connected segments to see if any form a loop of length 4.
-    // Add those to the quads list.
-    vector<Quad> quads;
-
-    vector<Segment *> tmp(5);
-    for (unsigned int i = 0; i < segments.size(); i++)
-    {
-      tmp[0] = &segments[i];
-      Quad::search(fimOrig, tmp, segments[i], 0, quads, opticalCenter);
+      if (quads.size() > options.maxQuads)
+      {
+        quads.erase(quads.begin() + options.maxQuads, quads.end());
+        status.quadsCapped = true;
+      }
     }
+    status.numQuads += quads.size();
 
 #ifdef DEBUG_APRIL
     {
@@ -462,128 +1153,227 @@ namespace AprilTags
 #endif
 
     //================================================================
-    // Step eight. Decode the quads. For each quad, we first estimate a
-    // threshold color to decide between 0 and 1. Then, we read off the
-    // bits and see if they make sense.
+    // Step eight. Decode the quads, each into its own slot.
+    vector<TagDetection> &decoded = ws.decoded;
+    vector<char> &decodedGood = ws.decodedGood;
+    const int numQuads = (int)quads.size();
+    decoded.resize(numQuads);
+    decodedGood.assign(numQuads, 0);
+
+    std::atomic<bool> expired(false);
+    const EdgeRefiner refiner((float)decimate + 1, &options.camera);
+    pool.parallelFor(numQuads, pool.chunkSize(numQuads), [&](int q0, int q1) {
+      std::vector<XYWeight> refineSamples;
+      for (int qi = q0; qi < q1; qi++)
+      {
+        // out of time: keep what we have decoded so far and go on with Step nine
+        if (expired || deadlineExpired(deadline))
+        {
+          expired = true;
+          break;
+        }
+        if (decimate > 1)
+          upscaleQuad(quads[qi], decimate, window, image, refiner, refineSamples, opticalCenter);
+        decodedGood[qi] = decodeQuad(quads[qi], fim, window, decoded[qi]);
+        if (decodedGood[qi] && onTag)
+          onTag(decoded[qi]);
+      }
+    });
+    if (expired)
+      status.partial = true;
 
-    std::vector<TagDetection> detections;
+    for (int qi = 0; qi < numQuads; qi++)
+    {
+      if (decodedGood[qi])
+        detections.push_back(decoded[qi]);
+    }
 
-    for (unsigned int qi = 0; qi < quads.size(); qi++)
+#ifdef DEBUG_APRIL
     {
-      Quad &quad = quads[qi];
+      cv::imshow("debug_april", image);
+    }
+#endif
 
-      // Find a threshold
-      GrayModel blackModel, whiteModel;
-      const int dd = 2 * thisTagFamily.blackBorder + thisTagFamily.dimension;
+    // cout << "AprilTags: edges=" << nEdges << " clusters=" << clusters.size() << " segments=" << segments.size()
+    //      << " quads=" << quads.size() << " detections=" << detections.size() << endl;
+  }
 
-      for (int iy = -1; iy <= dd; iy++)
+  bool TagDetector::readCode(Quad &quad, const TagFamily &family, const CameraModel &camera, const FloatImage &fim,
+                             const cv::Rect &window, unsigned long long &tagCode)
+  {
+    const int width = window.width;
+    const int height = window.height;
+
+    // Find a threshold
+    GrayModel blackModel, whiteModel;
+    const int dd = 2 * family.blackBorder + family.dimension;
+
+    for (int iy = -1; iy <= dd; iy++)
+    {
+      float y = (iy + 0.5f) / dd;
+      for (int ix = -1; ix <= dd; ix++)
       {
-        float y = (iy + 0.5f) / dd;
-        for (int ix = -1; ix <= dd; ix++)
-        {
-          float x = (ix + 0.5f) / dd;
-          std::pair<float, float> pxy = quad.interpolate01(x, y);
-          int irx = (int)(pxy.first + 0.5);
-          int iry = (int)(pxy.second + 0.5);
-          if (irx < 0 || irx >= width || iry < 0 || iry >= height)
-            continue;
-          float v = fim.get(irx, iry);
-          if (iy == -1 || iy == dd || ix == -1 || ix == dd)
-            whiteModel.addObservation(x, y, v);
-          else if (iy == 0 || iy == (dd - 1) || ix == 0 || ix == (dd - 1))
-            blackModel.addObservation(x, y, v);
-        }
+        float x = (ix + 0.5f) / dd;
+        std::pair<float, float> pxy = camera.distort(quad.interpolate01(x, y));
+        int irx = (int)(pxy.first + 0.5) - window.x;
+        int iry = (int)(pxy.second + 0.5) - window.y;
+        if (irx < 0 || irx >= width || iry < 0 || iry >= height)
+          continue;
+        float v = fim.get(irx, iry);
+        if (iy == -1 || iy == dd || ix == -1 || ix == dd)
+          whiteModel.addObservation(x, y, v);
+        else if (iy == 0 || iy == (dd - 1) || ix == 0 || ix == (dd - 1))
+          blackModel.addObservation(x, y, v);
       }
+    }
 
-      bool bad = false;
-      unsigned long long tagCode = 0;
-      for (int iy = thisTagFamily.dimension - 1; iy >= 0; iy--)
+    bool bad = false;
+    tagCode = 0;
+    for (int iy = family.dimension - 1; iy >= 0; iy--)
+    {
+      float y = (family.blackBorder + iy + 0.5f) / dd;
+      for (int ix = 0; ix < family.dimension; ix++)
       {
-        float y = (thisTagFamily.blackBorder + iy + 0.5f) / dd;
-        for (int ix = 0; ix < thisTagFamily.dimension; ix++)
+        float x = (family.blackBorder + ix + 0.5f) / dd;
+        std::pair<float, float> pxy = camera.distort(quad.interpolate01(x, y));
+        int irx = (int)(pxy.first + 0.5) - window.x;
+        int iry = (int)(pxy.second + 0.5) - window.y;
+        if (irx < 0 || irx >= width || iry < 0 || iry >= height)
         {
-          float x = (thisTagFamily.blackBorder + ix + 0.5f) / dd;
-          std::pair<float, float> pxy = quad.interpolate01(x, y);
-          int irx = (int)(pxy.first + 0.5);
-          int iry = (int)(pxy.second + 0.5);
-          if (irx < 0 || irx >= width || iry < 0 || iry >= height)
-          {
-            // cout << "*** bad:  irx=" << irx << "  iry=" << iry << endl;
-            bad = true;
-            continue;
-          }
-          float threshold = (blackModel.interpolate(x, y) + whiteModel.interpolate(x, y)) * 0.5f;
-          float v = fim.get(irx, iry);
-          tagCode = tagCode << 1;
-          if (v > threshold)
-            tagCode |= 1;
-#ifdef DEBUG_APRIL
-          {
-            if (v > threshold)
-              cv::circle(image, cv::Point2f(irx, iry), 1, cv::Scalar(0, 0, 255, 0), 2);
-            else
-              cv::circle(image, cv::Point2f(irx, iry), 1, cv::Scalar(0, 255, 0, 0), 2);
-          }
-#endif
+          // cout << "*** bad:  irx=" << irx << "  iry=" << iry << endl;
+          bad = true;
+          continue;
         }
+        float threshold = (blackModel.interpolate(x, y) + whiteModel.interpolate(x, y)) * 0.5f;
+        float v = fim.get(irx, iry);
+        tagCode = tagCode << 1;
+        if (v > threshold)
+          tagCode |= 1;
       }
+    }
+    return !bad;
+  }
 
-      if (!bad)
+  bool TagDetector::decodeQuad(Quad &quad, const FloatImage &fim, const cv::Rect &window, TagDetection &detection) const
+  {
+    //================================================================
+    // Step eight. Decode the quads. For each quad, we first estimate a
+    // threshold color to decide between 0 and 1. Then, we read off the
+    // bits and see if they make sense. With several families, the quad
+    // is read at the lattice of each one until one of them decodes it.
+    detection = TagDetection();
+    size_t f = 0;
+    for (; f < tagFamilies.size(); f++)
+    {
+      unsigned long long tagCode;
+      if (!readCode(quad, tagFamilies[f], options.camera, fim, window, tagCode))
+        continue;
+      tagFamilies[f].decode(detection, tagCode);
+      if (detection.good)
+        break;
+    }
+    if (f == tagFamilies.size())
+      return false;
+    detection.family = (int)f;
+
+    // compute the homography (and rotate it appropriately)
+    detection.homography = quad.homography.getH();
+    detection.hxy = quad.homography.getCXY();
+
+    float c = std::cos(detection.rotation * (float)CV_PI / 2);
+    float s = std::sin(detection.rotation * (float)CV_PI / 2);
+    Eigen::Matrix3d R;
+    R.setZero();
+    R(0, 0) = R(1, 1) = c;
+    R(0, 1) = -s;
+    R(1, 0) = s;
+    R(2, 2) = 1;
+    Eigen::Matrix3d tmp;
+    tmp = detection.homography * R;
+    detection.homography = tmp;
+
+    // Rotate points in detection according to decoded
+    // orientation.  Thus the order of the points in the
+    // detection object can be used to determine the
+    // orientation of the target.
+    std::pair<float, float> bottomLeft = detection.interpolate(-1, -1);
+    int bestRot = -1;
+    float bestDist = FLT_MAX;
+    for (int i = 0; i < 4; i++)
+    {
+      float const dist = AprilTags::MathUtil::distance2D(bottomLeft, quad.quadPoints[i]);
+      if (dist < bestDist)
       {
-        TagDetection thisTagDetection;
-        thisTagFamily.decode(thisTagDetection, tagCode);
-
-        // compute the homography (and rotate it appropriately)
-        thisTagDetection.homography = quad.homography.getH();
-        thisTagDetection.hxy = quad.homography.getCXY();
-
-        float c = std::cos(thisTagDetection.rotation * (float)CV_PI / 2);
-        float s = std::sin(thisTagDetection.rotation * (float)CV_PI / 2);
-        Eigen::Matrix3d R;
-        R.setZero();
-        R(0, 0) = R(1, 1) = c;
-        R(0, 1) = -s;
-        R(1, 0) = s;
-        R(2, 2) = 1;
-        Eigen::Matrix3d tmp;
-        tmp = thisTagDetection.homography * R;
-        thisTagDetection.homography = tmp;
-
-        // Rotate points in detection according to decoded
-        // orientation.  Thus the order of the points in the
-        // detection object can be used to determine the
-        // orientation of the target.
-        std::pair<float, float> bottomLeft = thisTagDetection.interpolate(-1, -1);
-        int bestRot = -1;
-        float bestDist = FLT_MAX;
-        for (int i = 0; i < 4; i++)
-        {
-          float const dist = AprilTags::MathUtil::distance2D(bottomLeft, quad.quadPoints[i]);
-          if (dist < bestDist)
-          {
-            bestDist = dist;
-            bestRot = i;
-          }
-        }
-
-        for (int i = 0; i < 4; i++)
-          thisTagDetection.p[i] = quad.quadPoints[(i + bestRot) % 4];
-
-        if (thisTagDetection.good)
-        {
-          thisTagDetection.cxy = quad.interpolate01(0.5f, 0.5f);
-          thisTagDetection.observedPerimeter = quad.observedPerimeter;
-          detections.push_back(thisTagDetection);
-        }
+        bestDist = dist;
+        bestRot = i;
       }
     }
 
-#ifdef DEBUG_APRIL
+    for (int i = 0; i < 4; i++)
     {
-      cv::imshow("debug_april", image);
+      detection.pUndistorted[i] = quad.quadPoints[(i + bestRot) % 4];
+      detection.p[i] = options.camera.distort(detection.pUndistorted[i]);
     }
-#endif
 
+    detection.cxy = options.camera.distort(quad.interpolate01(0.5f, 0.5f));
+    detection.observedPerimeter = quad.observedPerimeter;
+    return true;
+  }
+
+  bool TagDetector::decodeAt(const cv::Mat &image, const std::pair<float, float> corners[4], float searchRange,
+                             TagDetection &detection) const
+  {
+    std::vector<std::pair<float, float>> p(corners, corners + 4);
+    if (searchRange > 0 && !EdgeRefiner(searchRange, &options.camera).refine(image, &p[0]))
+      return false;
+
+    // Step eight samples the white border one cell outside of the quad
+    std::pair<float, float> imageCorners[4];
+    for (int i = 0; i < 4; i++)
+      imageCorners[i] = options.camera.distort(p[i]);
+    float x0 = imageCorners[0].first, x1 = x0, y0 = imageCorners[0].second, y1 = y0;
+    for (int i = 1; i < 4; i++)
+    {
+      x0 = std::min(x0, imageCorners[i].first);
+      x1 = std::max(x1, imageCorners[i].first);
+      y0 = std::min(y0, imageCorners[i].second);
+      y1 = std::max(y1, imageCorners[i].second);
+    }
+    int dd = INT_MAX;
+    for (size_t f = 0; f < tagFamilies.size(); f++)
+      dd = std::min(dd, 2 * tagFamilies[f].blackBorder + tagFamilies[f].dimension);
+    const float border = std::max(x1 - x0, y1 - y0) / dd + roiMargin;
+    cv::Rect window((int)std::floor(x0 - border), (int)std::floor(y0 - border),
+                    (int)std::ceil(x1 - x0 + 2 * border), (int)std::ceil(y1 - y0 + 2 * border));
+    window &= cv::Rect(0, 0, image.cols, image.rows);
+    if (window.width < 3 || window.height < 3)
+      return false;
+
+    WorkspaceLease lease(*this);
+    TagDetectorWorkspace &ws = lease.workspace();
+    ws.fimOrig.resize(window.width, window.height);
+    for (int y = 0; y < window.height; y++)
+    {
+      const uchar *row = image.ptr<uchar>(window.y + y) + window.x;
+      for (int x = 0; x < window.width; x++)
+        ws.fimOrig.set(x, y, row[x] / 255.);
+    }
+    if (sigma > 0)
+    {
+      ws.fim = ws.fimOrig;
+      ws.fim.filterFactoredCentered(filter, filter, ws.filterScratch);
+    }
+
+    Quad quad(p, std::make_pair((float)(image.cols / 2), (float)(image.rows / 2)));
+    quad.observedPerimeter = 0;
+    for (int i = 0; i < 4; i++)
+      quad.observedPerimeter += MathUtil::distance2D(p[i], p[(i + 1) % 4]);
+    return decodeQuad(quad, (sigma > 0) ? ws.fim : ws.fimOrig, window, detection);
+  }
+
+  void TagDetector::mergeDetections(const std::vector<TagDetection> &detections,
+                                    std::vector<TagDetection> &goodDetections)
+  {
     //================================================================
     // Step nine: Some quads may be detected more than once, due to
     // partial occlusion and our aggressive attempts to recover from
@@ -591,8 +1381,6 @@ namespace AprilTags
     // keep the one with the lowest error, and if the error is the same,
     // the one with the greatest observed perimeter.
 
-    std::vector<TagDetection> goodDetections;
-
     // NOTE: allow multiple non-overlapping detections of the same target.
 
     for (vector<TagDetection>::const_iterator it = detections.begin();
@@ -606,7 +1394,7 @@ namespace AprilTags
       {
         TagDetection &otherTagDetection = goodDetections[odidx];
 
-        if (thisTagDetection.id != otherTagDetection.id ||
+        if (thisTagDetection.id != otherTagDetection.id || thisTagDetection.family != otherTagDetection.family ||
             !thisTagDetection.overlapsTooMuch(otherTagDetection))
           continue;
 
@@ -627,10 +1415,6 @@ namespace AprilTags
         goodDetections.push_back(thisTagDetection);
     }
 
-    // cout << "AprilTags: edges=" << nEdges << " clusters=" << clusters.size() << " segments=" << segments.size()
-    //      << " quads=" << quads.size() << " detections=" << detections.size() << " unique tags=" << goodDetections.size() << endl;
-
-    return goodDetections;
   }
 
 } // namespace
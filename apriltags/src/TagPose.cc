@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <cmath>
+
+#include "apriltags/TagPose.h"
+
+namespace AprilTags
+{
+
+  TagPose::TagPose() : good(false)
+  {
+    for (int k = 0; k < 2; k++)
+    {
+      R[k].setIdentity();
+      t[k].setZero();
+      error[k] = 0;
+    }
+  }
+
+  bool estimateTagPose(const TagDetection &detection, double tagSize, double fx, double fy, double px, double py,
+                       TagPose &pose)
+  {
+    pose.good = false;
+    const double s = tagSize / 2;
+
+    // homography from the tag plane (metres, centred) to normalized image coordinates
+    Eigen::Matrix3d Kinv;
+    Kinv << 1 / fx, 0, (detection.hxy.first - px) / fx,
+        0, 1 / fy, (detection.hxy.second - py) / fy,
+        0, 0, 1;
+    Eigen::Matrix3d H = Kinv * detection.homography * Eigen::Vector3d(1 / s, 1 / s, 1).asDiagonal();
+    if (H(2, 2) == 0)
+      return false;
+    H /= H(2, 2);
+
+    // the image v of the tag centre, and the derivative J of the homography there
+    const Eigen::Vector2d v(H(0, 2), H(1, 2));
+    const Eigen::Matrix2d J = H.topLeftCorner<2, 2>() - v * H.block<1, 2>(2, 0);
+
+    // Rv rotates the optical axis onto the line of sight of the tag centre
+    const Eigen::Vector3d u = Eigen::Vector3d(v(0), v(1), 1).normalized();
+    Eigen::Matrix3d k;
+    k << 0, 0, u(0),
+        0, 0, u(1),
+        -u(0), -u(1), 0;
+    const Eigen::Matrix3d Rv = Eigen::Matrix3d::Identity() + k + k * k / (1 + u(2));
+
+    // in the frame of Rv, J is the top 2x2 block of the first two rotation columns, scaled by
+    // the inverse depth: its largest singular value gamma
+    const Eigen::Matrix2d B = Rv.topLeftCorner<2, 2>() - v * Rv.block<1, 2>(2, 0);
+    const Eigen::Matrix2d A = B.inverse() * J;
+    const double a00 = A.row(0).squaredNorm(), a01 = A.row(0).dot(A.row(1)), a11 = A.row(1).squaredNorm();
+    const double gamma = std::sqrt(0.5 * (a00 + a11 + std::sqrt((a00 - a11) * (a00 - a11) + 4 * a01 * a01)));
+    if (!(gamma > 1e-12))
+      return false;
+    const Eigen::Matrix2d Rt = A / gamma;
+
+    // the missing row of the two columns, up to its sign: the two solutions
+    double b0 = std::sqrt(std::max(0.0, 1 - Rt.col(0).squaredNorm()));
+    double b1 = std::sqrt(std::max(0.0, 1 - Rt.col(1).squaredNorm()));
+    if (Rt.col(0).dot(Rt.col(1)) > 0)
+      b1 = -b1;
+
+    // corners in the cyclic order of TagDetection::p, as in TagDetection::getRelativeTransform
+    const Eigen::Vector3d corners[4] = {Eigen::Vector3d(-s, -s, 0), Eigen::Vector3d(s, -s, 0),
+                                        Eigen::Vector3d(s, s, 0), Eigen::Vector3d(-s, s, 0)};
+    Eigen::Vector2d observed[4];
+    for (int i = 0; i < 4; i++)
+      observed[i] << (detection.pUndistorted[i].first - px) / fx, (detection.pUndistorted[i].second - py) / fy;
+
+    for (int sol = 0; sol < 2; sol++)
+    {
+      const double sign = sol == 0 ? 1 : -1;
+      Eigen::Matrix3d R;
+      R.col(0) << Rt(0, 0), Rt(1, 0), sign * b0;
+      R.col(1) << Rt(0, 1), Rt(1, 1), sign * b1;
+      R.col(2) = R.col(0).cross(R.col(1));
+      R = Rv * R;
+
+      // translation: linear least squares on [1 0 -x; 0 1 -y] (R X + t) = 0 over the corners
+      Eigen::Matrix3d M = Eigen::Matrix3d::Zero();
+      Eigen::Vector3d b = Eigen::Vector3d::Zero();
+      for (int i = 0; i < 4; i++)
+      {
+        Eigen::Matrix<double, 2, 3> P;
+        P << 1, 0, -observed[i](0),
+            0, 1, -observed[i](1);
+        Eigen::Matrix3d PtP = P.transpose() * P;
+        M += PtP;
+        b -= PtP * (R * corners[i]);
+      }
+      const Eigen::Vector3d t = M.ldlt().solve(b);
+
+      double sum2 = 0;
+      for (int i = 0; i < 4; i++)
+      {
+        Eigen::Vector3d Xc = R * corners[i] + t;
+        double dx = fx * (Xc(0) / Xc(2) - observed[i](0));
+        double dy = fy * (Xc(1) / Xc(2) - observed[i](1));
+        sum2 += dx * dx + dy * dy;
+      }
+      pose.R[sol] = R;
+      pose.t[sol] = t;
+      pose.error[sol] = std::sqrt(sum2 / 4);
+    }
+
+    if (pose.error[1] < pose.error[0])
+    {
+      std::swap(pose.R[0], pose.R[1]);
+      std::swap(pose.t[0], pose.t[1]);
+      std::swap(pose.error[0], pose.error[1]);
+    }
+    pose.good = true;
+    return true;
+  }
+
+  void estimateTagPoses(const std::vector<TagDetection> &detections, double tagSize, double fx, double fy,
+                        double px, double py, std::vector<TagPose> &outPoses)
+  {
+    outPoses.resize(detections.size());
+    for (size_t i = 0; i < detections.size(); i++)
+      estimateTagPose(detections[i], tagSize, fx, fy, px, py, outPoses[i]);
+  }
+
+} // namespace
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+#include "apriltags/ThreadPool.h"
+
+namespace AprilTags
+{
+
+  //! One parallelFor loop; shared by the caller and the workers helping with it
+  struct ThreadPool::Job
+  {
+    Job(const Body &body, int n, int chunkSize)
+        : body(body), n(n), chunkSize(chunkSize), numChunks((n + chunkSize - 1) / chunkSize),
+          nextChunk(0), doneChunks(0), error() {}
+
+    const Body &body;
+    const int n;
+    const int chunkSize;
+    const int numChunks;
+
+    std::atomic<int> nextChunk;
+    int doneChunks; //!< guarded by mutex
+    std::exception_ptr error; //!< first exception thrown by the body, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+
+  ThreadPool::ThreadPool(unsigned int numThreads)
+      : workers(), jobs(), mutex(), jobAvailable(), stopping(false)
+  {
+    if (numThreads == 0)
+      numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int i = 1; i < numThreads; i++)
+      workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+  }
+
+  ThreadPool::~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    jobAvailable.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+      workers[i].join();
+  }
+
+  int ThreadPool::chunkSize(int n, int chunksPerThread) const
+  {
+    int numChunks = std::max(1, (int)size() * chunksPerThread);
+    return std::max(1, (n + numChunks - 1) / numChunks);
+  }
+
+  bool ThreadPool::runChunk(Job &job)
+  {
+    int chunk = job.nextChunk++;
+    if (chunk >= job.numChunks)
+      return false;
+
+    int begin = chunk * job.chunkSize;
+    int end = std::min(job.n, begin + job.chunkSize);
+    std::exception_ptr error;
+    try
+    {
+      job.body(begin, end);
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(job.mutex);
+    if (error && !job.error)
+      job.error = error;
+    if (++job.doneChunks == job.numChunks)
+      job.finished.notify_all();
+    return true;
+  }
+
+  void ThreadPool::parallelFor(int n, int chunkSize, const Body &body)
+  {
+    if (n <= 0)
+      return;
+    chunkSize = std::max(1, chunkSize);
+
+    // nothing to share: run on the calling thread
+    if (workers.empty() || chunkSize >= n)
+    {
+      for (int begin = 0; begin < n; begin += chunkSize)
+        body(begin, std::min(n, begin + chunkSize));
+      return;
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>(body, n, chunkSize);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(job);
+    }
+    jobAvailable.notify_all();
+
+    while (runChunk(*job))
+      ;
+
+    {
+      std::unique_lock<std::mutex> lock(job->mutex);
+      while (job->doneChunks < job->numChunks)
+        job->finished.wait(lock);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::deque<std::shared_ptr<Job>>::iterator it = std::find(jobs.begin(), jobs.end(), job);
+      if (it != jobs.end())
+        jobs.erase(it);
+    }
+
+    if (job->error)
+      std::rethrow_exception(job->error);
+  }
+
+  void ThreadPool::workerLoop()
+  {
+    while (true)
+    {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping && jobs.empty())
+          jobAvailable.wait(lock);
+        if (stopping)
+          return;
+
+        job = jobs.front();
+        // all chunks handed out: the job only waits for its last chunks to finish
+        if (job->nextChunk >= job->numChunks)
+        {
+          jobs.pop_front();
+          continue;
+        }
+      }
+
+      while (runChunk(*job))
+        ;
+    }
+  }
+
+} // namespace
@@ -19,6 +19,13 @@ namespace AprilTags
     return root;
   }
 
+  int UnionFindSimple::findRepresentative(int thisId) const
+  {
+    while (data[thisId].id != thisId)
+      thisId = data[thisId].id;
+    return thisId;
+  }
+
   void UnionFindSimple::printDataVector() const
   {
     for (unsigned int i = 0; i < data.size(); i++)
@@ -1,5 +1,8 @@
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <Eigen/Dense>
 
 // #include <Eigen/Core>
 // #include <opencv2/core/core.hpp>
@@ -7,7 +10,9 @@
 // #include <opencv2/imgproc/imgproc.hpp>
 
 #include "apriltags/TagDetector.h"
+#include "apriltags/EdgeRefiner.h"
 #include "apriltags/Tag36h11.h"
+#include "apriltags/ThreadPool.h"
 #include "apriltags/gridDetector.hpp"
 
 namespace calibration_toolkit
@@ -16,7 +21,7 @@ namespace calibration_toolkit
       const Eigen::MatrixXd &inImagePoints,
       const std::vector<bool> &inCornerObserved,
       std::vector<cv::Point3d> &outObjectP3ds,
-      std::vector<cv::Point2d> &outImageP2ds)
+      std::vector<cv::Point2d> &outImageP2ds) const
   {
 
     outImageP2ds.clear();
@@ -26,7 +31,7 @@ namespace calibration_toolkit
       if (inCornerObserved[i])
       {
         cv::Point2d p2d(inImagePoints(i, 0), inImagePoints(i, 1));
-        cv::Point3d p3d(points()(i, 0), points()(i, 1), points()(i, 2));
+        cv::Point3d p3d(_points(i, 0), _points(i, 1), _points(i, 2));
         outImageP2ds.push_back(p2d);
         outObjectP3ds.push_back(p3d);
         // cv::circle(frame, p2d, 1, CV_RGB(255, 0, 0), 1);
@@ -35,13 +40,34 @@ namespace calibration_toolkit
     }
   };
 
-  AprilgridDetector::~AprilgridDetector(){};
-
-  Eigen::MatrixXd AprilgridDetector::points() const
+  void AprilgridDetector::convertResults_OpenCV(
+      const Eigen::MatrixXd &inImagePoints,
+      const std::vector<bool> &inCornerObserved,
+      cv::Mat &outObjectPoints,
+      cv::Mat &outImagePoints) const
   {
-    return _points;
+    int n = (int)std::count(inCornerObserved.begin(), inCornerObserved.end(), true);
+    outObjectPoints.create(n, 3, CV_64F);
+    outImagePoints.create(n, 2, CV_64F);
+
+    int k = 0;
+    for (size_t i = 0; i < inImagePoints.rows(); i++)
+    {
+      if (!inCornerObserved[i])
+        continue;
+      double *p2d = outImagePoints.ptr<double>(k);
+      double *p3d = outObjectPoints.ptr<double>(k);
+      p2d[0] = inImagePoints(i, 0);
+      p2d[1] = inImagePoints(i, 1);
+      p3d[0] = _points(i, 0);
+      p3d[1] = _points(i, 1);
+      p3d[2] = _points(i, 2);
+      k++;
+    }
   }
 
+  AprilgridDetector::~AprilgridDetector(){};
+
   Eigen::Vector3d AprilgridDetector::point(size_t i) const
   {
     return _points.row(i);
@@ -86,11 +112,17 @@ namespace calibration_toolkit
   ///   |-->x
   AprilgridDetector::AprilgridDetector(
       double tagSize, double tagSpacing, const AprilgridOptions &options)
+      : AprilgridDetector(6, 6, tagSize, tagSpacing, 0, options) {}
+
+  AprilgridDetector::AprilgridDetector(
+      size_t tagRows, size_t tagCols, double tagSize, double tagSpacing, int idOffset,
+      const AprilgridOptions &options)
       : // GridCalibrationTargetBase(2 * tagRows, 2 * tagCols), // 4 points per tag
-        _rows(2 * 6),
-        _cols(2 * 6),
+        _rows(2 * tagRows),
+        _cols(2 * tagCols),
         _tagSize(tagSize),
         _tagSpacing(tagSpacing),
+        _idOffset(idOffset),
         _options(options),
         _tagCodes(AprilTags::tagCodes36h11)
   {
@@ -108,7 +140,18 @@ namespace calibration_toolkit
       cv::namedWindow("Aprilgrid: Tag detection", cv::WINDOW_NORMAL);
       cv::namedWindow("Aprilgrid: Tag corners", cv::WINDOW_NORMAL);
     }
-    _tagDetector = std::make_shared<AprilTags::TagDetector>(_tagCodes, _options.blackTagBorder);
+    AprilTags::TagDetector::TagDetectorOptions detectorOptions;
+    detectorOptions.maxClusters = _options.maxClusters;
+    detectorOptions.maxChildrenPerSegment = _options.maxChildrenPerSegment;
+    detectorOptions.maxQuads = _options.maxQuads;
+    detectorOptions.numThreads = _options.numThreads;
+    detectorOptions.tileSize = _options.tileSize;
+    detectorOptions.maxTagSize = _options.maxTagSize;
+    detectorOptions.threadPool = _options.threadPool;
+    detectorOptions.asyncThreads = _options.asyncThreads;
+    detectorOptions.decimate = _options.decimate;
+    detectorOptions.camera = _options.camera;
+    _tagDetector = std::make_shared<AprilTags::TagDetector>(_tagCodes, _options.blackTagBorder, detectorOptions);
   }
 
   void AprilgridDetector::createGridPoints()
@@ -135,35 +178,911 @@ namespace calibration_toolkit
       const cv::Mat &image, Eigen::MatrixXd &outImagePoints,
       std::vector<bool> &outCornerObserved) const
   {
+    AprilTags::TagDetector::ExtractionStatus status;
+    return computeObservation(image, outImagePoints, outCornerObserved, status);
+  }
 
-    bool success = true;
+  bool AprilgridDetector::computeObservation(
+      const cv::Mat &image, Eigen::MatrixXd &outImagePoints,
+      std::vector<bool> &outCornerObserved,
+      AprilTags::TagDetector::ExtractionStatus &outStatus,
+      const AprilTags::TagDetector::Clock::time_point &deadline) const
+  {
+    ObservationStatus status;
+    bool success = computeObservation(image, outImagePoints, outCornerObserved, status, deadline);
+    outStatus = status.extraction;
+    return success;
+  }
+
+  void AprilgridDetector::recoverTags(const cv::Mat &image, std::vector<AprilTags::TagDetection> &detections,
+                                      ObservationStatus &status) const
+  {
+    const int numTags = (int)size() / 4;
+    if (detections.size() < 2 || detections.size() >= (size_t)numTags)
+      return;
+
+    // board-to-image homography of the detected tags; RANSAC, since it predicts from all of them
+    std::vector<cv::Point2f> boardPoints, imagePoints;
+    std::vector<char> detected(numTags, 0);
+    for (size_t i = 0; i < detections.size(); i++)
+    {
+      detected[detections[i].id - _idOffset] = 1;
+      size_t pIdx[4];
+      tagPointIndices(detections[i].id, pIdx);
+      for (int j = 0; j < 4; j++)
+      {
+        boardPoints.push_back(cv::Point2f((float)_points(pIdx[j], 0), (float)_points(pIdx[j], 1)));
+        imagePoints.push_back(cv::Point2f(detections[i].pUndistorted[j].first, detections[i].pUndistorted[j].second));
+      }
+    }
+    // undistorted, where the board is a plane seen by a pinhole camera
+    cv::Mat H = cv::findHomography(boardPoints, imagePoints, cv::RANSAC, _options.recoverySearchRange);
+    if (H.empty())
+      return;
+
+    std::vector<int> missing;
+    for (int k = 0; k < numTags; k++)
+      if (!detected[k])
+        missing.push_back(_idOffset + k);
+
+    // each missing tag is decoded in a small window of its own
+    const float range = (float)_options.recoverySearchRange;
+    const int numMissing = (int)missing.size();
+    std::vector<AprilTags::TagDetection> recovered(numMissing);
+    std::vector<char> found(numMissing, 0);
+    AprilTags::ThreadPool &pool = _tagDetector->pool();
+    pool.parallelFor(numMissing, pool.chunkSize(numMissing), [&](int m0, int m1) {
+      for (int m = m0; m < m1; m++)
+      {
+        size_t pIdx[4];
+        tagPointIndices(missing[m], pIdx);
+        AprilTags::TagDetection predicted;
+        for (int j = 0; j < 4; j++)
+        {
+          double x = _points(pIdx[j], 0), y = _points(pIdx[j], 1);
+          double w = H.at<double>(2, 0) * x + H.at<double>(2, 1) * y + H.at<double>(2, 2);
+          predicted.pUndistorted[j] = std::make_pair(
+              (float)((H.at<double>(0, 0) * x + H.at<double>(0, 1) * y + H.at<double>(0, 2)) / w),
+              (float)((H.at<double>(1, 0) * x + H.at<double>(1, 1) * y + H.at<double>(1, 2)) / w));
+          predicted.p[j] = _options.camera.distort(predicted.pUndistorted[j]);
+        }
+        // predicted outside of the image, or where the tag would be dropped anyway
+        if (nearBorder(predicted, image))
+          continue;
+
+        AprilTags::TagDetection &tag = recovered[m];
+        if (!_tagDetector->decodeAt(image, predicted.pUndistorted, range, tag))
+          continue;
+        // the predicted tag, in the predicted rotation
+        float dx = tag.pUndistorted[0].first - predicted.pUndistorted[0].first;
+        float dy = tag.pUndistorted[0].second - predicted.pUndistorted[0].second;
+        found[m] = tag.id == missing[m] && dx * dx + dy * dy <= 4 * range * range && !nearBorder(tag, image);
+      }
+    });
+
+    for (int m = 0; m < numMissing; m++)
+      if (found[m])
+      {
+        detections.push_back(recovered[m]);
+        status.numTagsRecovered++;
+      }
+  }
+
+  bool AprilgridDetector::resolveDuplicateTags(std::vector<AprilTags::TagDetection> &detections,
+                                               ObservationStatus &status) const
+  {
+    size_t kept = 0;
+    for (size_t first = 0; first < detections.size();)
+    {
+      // detections[first, last) share one id
+      size_t last = first + 1;
+      while (last < detections.size() && detections[last].id == detections[first].id)
+        last++;
+
+      if (last - first == 1)
+      {
+        detections[kept++] = detections[first];
+      }
+      else
+      {
+        status.numDuplicateIds++;
+        if (_options.duplicateTagPolicy == DUPLICATES_KEEP_BEST)
+        {
+          size_t best = first;
+          for (size_t k = first + 1; k < last; k++)
+          {
+            if (detections[k].hammingDistance < detections[best].hammingDistance ||
+                (detections[k].hammingDistance == detections[best].hammingDistance &&
+                 detections[k].observedPerimeter > detections[best].observedPerimeter))
+              best = k;
+          }
+          detections[kept++] = detections[best];
+          status.numTagsDuplicate += last - first - 1;
+        }
+        else
+        {
+          status.numTagsDuplicate += last - first;
+        }
+      }
+      first = last;
+    }
+
+    if (status.numDuplicateIds > 0 && _options.duplicateTagPolicy == DUPLICATES_REJECT_FRAME)
+      return false;
+
+    detections.resize(kept);
+    return true;
+  }
+
+  bool AprilgridDetector::computeObservation(
+      const cv::Mat &image, Eigen::MatrixXd &outImagePoints,
+      std::vector<bool> &outCornerObserved,
+      ObservationStatus &outStatus,
+      const AprilTags::TagDetector::Clock::time_point &deadline) const
+  {
+    // Eigen matrices are column major: x of all points, then y of all points
+    outImagePoints.resize(size(), 2);
+    std::vector<unsigned char> observed(size());
+    if (!observe(image, outImagePoints.data(), 1, size(), &observed[0], outStatus,
+                 AprilTags::TagDetector::TagCallback(), deadline))
+      return false;
+
+    outCornerObserved.assign(observed.begin(), observed.end());
+    return true;
+  }
+
+  bool AprilgridDetector::computeObservation(
+      const cv::Mat &image, double *outImagePoints, unsigned char *outCornerObserved,
+      ObservationStatus &outStatus,
+      const AprilTags::TagDetector::Clock::time_point &deadline) const
+  {
+    return observe(image, outImagePoints, 2, 1, outCornerObserved, outStatus, AprilTags::TagDetector::TagCallback(),
+                   deadline);
+  }
+
+  bool AprilgridDetector::computeObservation(const cv::Mat &image, Observation &observation,
+                                             const AprilTags::TagDetector::Clock::time_point &deadline) const
+  {
+    observation.success = computeObservation(image, observation.imagePoints, observation.cornerObserved,
+                                             observation.status, deadline);
+    if (!observation.success)
+      observation.cornerObserved.assign(size(), false);
+    undistortObservation(observation);
+    return observation.success;
+  }
+
+  bool AprilgridDetector::computeObservation(const cv::Mat &image,
+                                             const std::vector<AprilTags::TagDetection> &detections,
+                                             Observation &observation) const
+  {
+    std::vector<AprilTags::TagDetection> gridDetections(detections);
+    observation.status = ObservationStatus();
+    observation.imagePoints.resize(size(), 2);
+    std::vector<unsigned char> observed(size()); // stays all 0 if the observation fails
+    observation.success = observeDetections(image, gridDetections, observation.imagePoints.data(), 1, size(),
+                                            &observed[0], observation.status);
+    observation.cornerObserved.assign(observed.begin(), observed.end());
+    undistortObservation(observation);
+    return observation.success;
+  }
+
+  bool AprilgridDetector::computeObservationProgressive(
+      const cv::Mat &image, const TagObservationCallback &onTag, const ObservationCallback &onComplete,
+      const AprilTags::TagDetector::Clock::time_point &deadline) const
+  {
+    AprilTags::TagDetector::TagCallback onDecoded;
+    if (onTag)
+      onDecoded = [&](const AprilTags::TagDetection &detection) {
+        TagObservation tag;
+        if (observeTag(image, detection, tag))
+          onTag(tag);
+      };
+
+    Observation observation;
+    observation.imagePoints.resize(size(), 2);
+    std::vector<unsigned char> observed(size()); // stays all 0 if the observation fails
+    observation.success = observe(image, observation.imagePoints.data(), 1, size(), &observed[0],
+                                  observation.status, onDecoded, deadline);
+    observation.cornerObserved.assign(observed.begin(), observed.end());
+    undistortObservation(observation);
+
+    if (onComplete)
+      onComplete(observation);
+    return observation.success;
+  }
+
+  bool AprilgridDetector::computeObservationTracked(const cv::Mat &image, TrackingState &state,
+                                                    Observation &observation,
+                                                    const AprilTags::TagDetector::Clock::time_point &deadline) const
+  {
+    bool fullFrame = state.tags.empty() ||
+                     (_options.trackingFullFrameInterval > 0 &&
+                      state.framesSinceFullFrame + 1 >= _options.trackingFullFrameInterval);
+    if (!fullFrame)
+    {
+      std::vector<cv::Rect> rois;
+      predictTagRegions(state, image, rois);
+
+      observation.imagePoints.resize(size(), 2);
+      std::vector<unsigned char> observed(size()); // stays all 0 if the observation fails
+      observation.success = observe(image, observation.imagePoints.data(), 1, size(), &observed[0],
+                                    observation.status, AprilTags::TagDetector::TagCallback(), deadline, &rois);
+      observation.cornerObserved.assign(observed.begin(), observed.end());
+      undistortObservation(observation);
+
+      // a tag left its region (or the image): search the whole frame again
+      size_t numFound = 0;
+      for (size_t i = 0; i < state.tags.size(); i++)
+        if (tagObserved(observation, state.tags[i].tagId))
+          numFound++;
+      if (!observation.success || numFound < state.tags.size())
+      {
+        fullFrame = true;
+        state.numTrackingLost++;
+      }
+      else
+      {
+        state.numTrackedFrames++;
+      }
+    }
+
+    if (fullFrame)
+    {
+      computeObservation(image, observation, deadline);
+      state.numFullFrames++;
+      state.framesSinceFullFrame = 0;
+    }
+    else
+    {
+      state.framesSinceFullFrame++;
+    }
+    state.fullFrame = fullFrame;
+
+    updateTracking(observation, state);
+    return observation.success;
+  }
+
+  void AprilgridDetector::predictTagRegions(const TrackingState &state, const cv::Mat &image,
+                                            std::vector<cv::Rect> &rois) const
+  {
+    const cv::Rect frame(0, 0, image.cols, image.rows);
+    rois.clear();
+    for (size_t i = 0; i < state.tags.size(); i++)
+    {
+      // constant velocity: the tag moves as much as it did since the frame before
+      const TrackingState::Tag &tag = state.tags[i];
+      double motion = std::sqrt(tag.motion[0] * tag.motion[0] + tag.motion[1] * tag.motion[1]);
+      double margin = _options.trackingMargin + _options.trackingMotionScale * motion;
+
+      double x0 = tag.imagePoints[0][0], x1 = x0, y0 = tag.imagePoints[0][1], y1 = y0;
+      for (int j = 1; j < 4; j++)
+      {
+        x0 = std::min(x0, tag.imagePoints[j][0]);
+        x1 = std::max(x1, tag.imagePoints[j][0]);
+        y0 = std::min(y0, tag.imagePoints[j][1]);
+        y1 = std::max(y1, tag.imagePoints[j][1]);
+      }
+      x0 += tag.motion[0] - margin;
+      x1 += tag.motion[0] + margin;
+      y0 += tag.motion[1] - margin;
+      y1 += tag.motion[1] + margin;
+
+      cv::Rect roi((int)std::floor(x0), (int)std::floor(y0),
+                   (int)std::ceil(x1) - (int)std::floor(x0), (int)std::ceil(y1) - (int)std::floor(y0));
+      roi &= frame;
+      if (roi.area() > 0)
+        rois.push_back(roi);
+    }
+  }
+
+  bool AprilgridDetector::computeObservationFlow(const cv::Mat &image, FlowTrackingState &state,
+                                                 Observation &observation,
+                                                 const AprilTags::TagDetector::Clock::time_point &deadline) const
+  {
+    // the pyramid is needed for the next frame either way; keep it apart from the caller's image buffer
+    const cv::Size window(_options.flowWindowSize, _options.flowWindowSize);
+    int numLevels = cv::buildOpticalFlowPyramid(image, state.nextPyramid, window, _options.flowPyramidLevels, true,
+                                                cv::BORDER_REFLECT_101, cv::BORDER_CONSTANT, false);
+
+    bool keyframe = state.points.empty() || state.pyramid.size() != state.nextPyramid.size() ||
+                    (_options.flowKeyframeInterval > 0 &&
+                     state.framesSinceKeyframe + 1 >= _options.flowKeyframeInterval);
+    if (!keyframe)
+    {
+      if (trackCorners(image, numLevels, state, observation))
+      {
+        state.numTrackedFrames++;
+      }
+      else
+      {
+        keyframe = true;
+        state.numTrackingLost++;
+      }
+    }
+
+    if (keyframe)
+    {
+      computeObservation(image, observation, deadline);
+      state.numKeyframes++;
+      state.framesSinceKeyframe = 0;
+    }
+    else
+    {
+      state.framesSinceKeyframe++;
+    }
+    state.keyframe = keyframe;
+
+    // the corners to track into the next frame
+    state.pointIds.clear();
+    state.points.clear();
+    if (observation.success)
+      for (size_t i = 0; i < size(); i++)
+        if (observation.cornerObserved[i])
+        {
+          state.pointIds.push_back(i);
+          state.points.push_back(cv::Point2f((float)observation.imagePoints(i, 0), (float)observation.imagePoints(i, 1)));
+        }
+    std::swap(state.pyramid, state.nextPyramid);
+    return observation.success;
+  }
+
+  bool AprilgridDetector::trackCorners(const cv::Mat &image, int numLevels, FlowTrackingState &state,
+                                       Observation &observation) const
+  {
+    std::vector<cv::Point2f> tracked;
+    std::vector<unsigned char> trackStatus;
+    std::vector<float> trackErrors;
+    const cv::Size window(_options.flowWindowSize, _options.flowWindowSize);
+    cv::calcOpticalFlowPyrLK(state.pyramid, state.nextPyramid, state.points, tracked, trackStatus, trackErrors,
+                             window, numLevels);
+
+    // tracks ending near the border are lost, like tags near the border
+    std::vector<size_t> pointIds;
+    std::vector<cv::Point2f> boardPoints, imagePoints, fitPoints;
+    for (size_t k = 0; k < tracked.size(); k++)
+    {
+      if (!trackStatus[k] ||
+          tracked[k].x < _options.minBorderDistance || tracked[k].x > image.cols - _options.minBorderDistance ||
+          tracked[k].y < _options.minBorderDistance || tracked[k].y > image.rows - _options.minBorderDistance)
+        continue;
+      pointIds.push_back(state.pointIds[k]);
+      boardPoints.push_back(cv::Point2f((float)_points(state.pointIds[k], 0), (float)_points(state.pointIds[k], 1)));
+      imagePoints.push_back(tracked[k]);
+      std::pair<float, float> u = _options.camera.undistort(std::make_pair(tracked[k].x, tracked[k].y));
+      fitPoints.push_back(cv::Point2f(u.first, u.second));
+    }
+    if (pointIds.size() < 4)
+      return false;
+
+    // the board is planar: the (undistorted) tracks of a rigid board agree with one homography
+    cv::Mat H = cv::findHomography(boardPoints, fitPoints, 0);
+    if (H.empty())
+      return false;
+    std::vector<double> residuals2(pointIds.size());
+    double sum2 = 0;
+    for (size_t k = 0; k < pointIds.size(); k++)
+    {
+      double x = boardPoints[k].x, y = boardPoints[k].y;
+      double w = H.at<double>(2, 0) * x + H.at<double>(2, 1) * y + H.at<double>(2, 2);
+      double dx = (H.at<double>(0, 0) * x + H.at<double>(0, 1) * y + H.at<double>(0, 2)) / w - fitPoints[k].x;
+      double dy = (H.at<double>(1, 0) * x + H.at<double>(1, 1) * y + H.at<double>(1, 2)) / w - fitPoints[k].y;
+      residuals2[k] = dx * dx + dy * dy;
+      sum2 += residuals2[k];
+    }
+    state.residual = std::sqrt(sum2 / pointIds.size());
+    if (state.residual > _options.flowMaxResidual)
+      return false;
+
+    observation = Observation();
+    observation.imagePoints.setZero(size(), 2);
+    observation.cornerObserved.assign(size(), false);
+    const double maxResidual2 = 9 * _options.flowMaxResidual * _options.flowMaxResidual;
+    size_t numObserved = 0;
+    for (size_t k = 0; k < pointIds.size(); k++)
+    {
+      if (residuals2[k] > maxResidual2)
+        continue;
+      observation.imagePoints(pointIds[k], 0) = imagePoints[k].x;
+      observation.imagePoints(pointIds[k], 1) = imagePoints[k].y;
+      observation.cornerObserved[pointIds[k]] = true;
+      numObserved++;
+    }
+    if (numObserved < 4 * _options.minTagsForValidObs ||
+        state.points.size() - numObserved > _options.flowMaxLostFraction * state.points.size())
+      return false;
+
+    observation.success = true;
+    observation.status.numCornersObserved = numObserved;
+    undistortObservation(observation);
+    return true;
+  }
+
+  void AprilgridDetector::undistortObservation(Observation &observation) const
+  {
+    observation.undistortedImagePoints = observation.imagePoints;
+    if (!_options.camera.hasDistortion())
+      return;
+    for (size_t i = 0; i < observation.cornerObserved.size(); i++)
+    {
+      if (!observation.cornerObserved[i])
+        continue;
+      std::pair<float, float> u = _options.camera.undistort(
+          std::make_pair((float)observation.imagePoints(i, 0), (float)observation.imagePoints(i, 1)));
+      observation.undistortedImagePoints(i, 0) = u.first;
+      observation.undistortedImagePoints(i, 1) = u.second;
+    }
+  }
+
+  bool AprilgridDetector::tagObserved(const Observation &observation, int tagId) const
+  {
+    size_t pointIndices[4];
+    tagPointIndices(tagId, pointIndices);
+    for (int j = 0; j < 4; j++)
+      if (observation.cornerObserved[pointIndices[j]])
+        return true;
+    return false;
+  }
+
+  void AprilgridDetector::updateTracking(const Observation &observation, TrackingState &state) const
+  {
+    std::vector<TrackingState::Tag> tags;
+    if (observation.success)
+    {
+      size_t previous = 0; // state.tags and the tag ids below are both in increasing order
+      for (int tagId = _idOffset; tagId < _idOffset + (int)size() / 4; tagId++)
+      {
+        if (!tagObserved(observation, tagId))
+          continue;
+
+        // the points of used tags are written even if refinement rejected some of them
+        size_t pointIndices[4];
+        tagPointIndices(tagId, pointIndices);
+
+        TrackingState::Tag tag;
+        tag.tagId = tagId;
+        double centre[2] = {0, 0};
+        for (int j = 0; j < 4; j++)
+        {
+          tag.imagePoints[j][0] = observation.imagePoints(pointIndices[j], 0);
+          tag.imagePoints[j][1] = observation.imagePoints(pointIndices[j], 1);
+          centre[0] += tag.imagePoints[j][0] / 4;
+          centre[1] += tag.imagePoints[j][1] / 4;
+        }
+
+        tag.motion[0] = tag.motion[1] = 0;
+        while (previous < state.tags.size() && state.tags[previous].tagId < tagId)
+          previous++;
+        if (previous < state.tags.size() && state.tags[previous].tagId == tagId)
+        {
+          const TrackingState::Tag &last = state.tags[previous];
+          tag.motion[0] = centre[0];
+          tag.motion[1] = centre[1];
+          for (int j = 0; j < 4; j++)
+          {
+            tag.motion[0] -= last.imagePoints[j][0] / 4;
+            tag.motion[1] -= last.imagePoints[j][1] / 4;
+          }
+        }
+        tags.push_back(tag);
+      }
+    }
+    state.tags.swap(tags);
+  }
+
+  void AprilgridDetector::refineCorners(const cv::Mat &image, cv::Mat &tagCorners) const
+  {
+    if (_options.cornerRefinement == CORNER_REFINEMENT_SUBPIX)
+    {
+      cv::cornerSubPix(
+          image, tagCorners, cv::Size(2, 2), cv::Size(-1, -1),
+          cv::TermCriteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, 30, 0.1));
+      return;
+    }
+
+    // the tags are independent: refine them in parallel, keeping the corners of a tag whose sides
+    // could not be refitted
+    const AprilTags::EdgeRefiner refiner((float)std::sqrt(_options.maxSubpixDisplacement2) + 1, &_options.camera);
+    const int numTags = tagCorners.rows / 4;
+    AprilTags::ThreadPool &pool = _tagDetector->pool();
+    pool.parallelFor(numTags, pool.chunkSize(numTags), [&](int t0, int t1) {
+      std::vector<AprilTags::XYWeight> samples;
+      std::pair<float, float> corners[4];
+      for (int t = t0; t < t1; t++)
+      {
+        // the sides are straight in undistorted coordinates
+        for (int j = 0; j < 4; j++)
+          corners[j] = _options.camera.undistort(
+              std::make_pair(tagCorners.at<float>(4 * t + j, 0), tagCorners.at<float>(4 * t + j, 1)));
+        if (!refiner.refine(image, corners, samples))
+          continue;
+        for (int j = 0; j < 4; j++)
+        {
+          std::pair<float, float> p = _options.camera.distort(corners[j]);
+          tagCorners.at<float>(4 * t + j, 0) = p.first;
+          tagCorners.at<float>(4 * t + j, 1) = p.second;
+        }
+      }
+    });
+  }
+
+  bool AprilgridDetector::nearBorder(const AprilTags::TagDetection &detection, const cv::Mat &image) const
+  {
+    bool near = false;
+    for (int j = 0; j < 4; j++)
+    {
+      near |= detection.p[j].first < _options.minBorderDistance;
+      near |= detection.p[j].first > (float)(image.cols) - _options.minBorderDistance; // width
+      near |= detection.p[j].second < _options.minBorderDistance;
+      near |= detection.p[j].second > (float)(image.rows) - _options.minBorderDistance; // height
+    }
+    return near;
+  }
+
+  void AprilgridDetector::tagPointIndices(int tagId, size_t pointIndices[4]) const
+  {
+    // calculate the grid idx for all four tag corners given the tagId and cols
+    tagId -= _idOffset;
+    size_t baseId = (int)(tagId / (_cols / 2)) * _cols * 2 + (tagId % (_cols / 2)) * 2;
+    pointIndices[0] = baseId;
+    pointIndices[1] = baseId + 1;
+    pointIndices[2] = baseId + _cols + 1;
+    pointIndices[3] = baseId + _cols;
+  }
+
+  bool AprilgridDetector::observeTag(const cv::Mat &image, const AprilTags::TagDetection &detection,
+                                     TagObservation &tag) const
+  {
+    // the same filters as observe, except for the duplicate tag policy which needs the whole frame
+    if (nearBorder(detection, image) || detection.good != 1 || detection.family != 0 || !onGrid(detection.id))
+      return false;
+
+    tag.tagId = detection.id;
+    tagPointIndices(detection.id, tag.pointIndices);
+
+    cv::Mat tagCorners(4, 2, CV_32F);
+    for (int j = 0; j < 4; j++)
+    {
+      tagCorners.at<float>(j, 0) = detection.p[j].first;
+      tagCorners.at<float>(j, 1) = detection.p[j].second;
+    }
+    if (_options.doSubpixRefinement)
+      refineCorners(image, tagCorners);
+
+    for (int j = 0; j < 4; j++)
+    {
+      double corner_x = tagCorners.at<float>(j, 0);
+      double corner_y = tagCorners.at<float>(j, 1);
+      double dx = corner_x - detection.p[j].first;
+      double dy = corner_y - detection.p[j].second;
+      tag.imagePoints[j][0] = corner_x;
+      tag.imagePoints[j][1] = corner_y;
+      tag.cornerObserved[j] = dx * dx + dy * dy <= _options.maxSubpixDisplacement2;
+    }
+    return true;
+  }
+
+  std::future<AprilgridDetector::Observation> AprilgridDetector::computeObservationAsync(
+      const cv::Mat &image, AprilTags::Executor::TaskId *outTaskId) const
+  {
+    // a cancelled task is destroyed without running, which breaks the promise of the future
+    std::shared_ptr<std::packaged_task<Observation()>> task =
+        std::make_shared<std::packaged_task<Observation()>>([this, image]() {
+          Observation observation;
+          computeObservation(image, observation);
+          return observation;
+        });
+    std::future<Observation> result = task->get_future();
+
+    AprilTags::Executor::TaskId id = executor().submit([task]() { (*task)(); });
+    if (outTaskId)
+      *outTaskId = id;
+    return result;
+  }
+
+  AprilTags::Executor::TaskId AprilgridDetector::computeObservationAsync(
+      const cv::Mat &image, const ObservationCallback &onComplete,
+      const AprilTags::Executor::Task &onCancelled) const
+  {
+    return executor().submit(
+        [this, image, onComplete]() {
+          Observation observation;
+          computeObservation(image, observation);
+          onComplete(observation);
+        },
+        onCancelled);
+  }
+
+  size_t AprilgridDetector::computeObservations(
+      const std::vector<cv::Mat> &images, std::vector<Observation> &outObservations) const
+  {
+    outObservations.resize(images.size());
+
+    // one image per chunk: the images take very different times, e.g. with and without a target.
+    // Concurrent calls borrow separate scratch buffers from the tag detector.
+    AprilTags::ThreadPool pool(_options.batchThreads);
+    pool.parallelFor((int)images.size(), 1, [&](int begin, int end) {
+      for (int i = begin; i < end; i++)
+        computeObservation(images[i], outObservations[i]);
+    });
+
+    size_t numSuccessful = 0;
+    for (size_t i = 0; i < outObservations.size(); i++)
+      if (outObservations[i].success)
+        numSuccessful++;
+    return numSuccessful;
+  }
+
+  size_t AprilgridDetector::computeObservations(
+      const ImageProducer &producer, std::vector<Observation> &outObservations) const
+  {
+    outObservations.clear();
+
+    AprilTags::ThreadPool pool(_options.batchThreads);
+    std::mutex mutex; // guards producer, outObservations and the state below
+    size_t numProduced = 0;
+    size_t numSuccessful = 0;
+    bool exhausted = false;
+
+    // every thread pulls images until the producer runs dry
+    pool.parallelFor((int)pool.size(), 1, [&](int, int) {
+      cv::Mat image;
+      Observation observation;
+      while (true)
+      {
+        size_t index;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (exhausted)
+            return;
+          try
+          {
+            exhausted = !producer(image);
+          }
+          catch (...)
+          {
+            // stop the other threads too; the pool rethrows once they returned
+            exhausted = true;
+            throw;
+          }
+          if (exhausted)
+            return;
+          index = numProduced++;
+        }
+
+        computeObservation(image, observation);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (outObservations.size() <= index)
+          outObservations.resize(index + 1);
+        std::swap(outObservations[index], observation);
+        if (outObservations[index].success)
+          numSuccessful++;
+      }
+    });
+
+    return numSuccessful;
+  }
+
+  size_t AprilgridDetector::gatherObservedCorners(
+      const double *imagePoints, const unsigned char *cornerObserved,
+      int *outIds, double *outImagePoints, double *outObjectPoints) const
+  {
+    size_t n = 0;
+    for (size_t i = 0; i < size(); i++)
+    {
+      if (!cornerObserved[i])
+        continue;
+      if (outIds)
+        outIds[n] = (int)i;
+      if (outImagePoints)
+      {
+        outImagePoints[2 * n] = imagePoints[2 * i];
+        outImagePoints[2 * n + 1] = imagePoints[2 * i + 1];
+      }
+      if (outObjectPoints)
+      {
+        outObjectPoints[3 * n] = _points(i, 0);
+        outObjectPoints[3 * n + 1] = _points(i, 1);
+        outObjectPoints[3 * n + 2] = _points(i, 2);
+      }
+      n++;
+    }
+    return n;
+  }
+
+  bool AprilgridDetector::estimatePose(const Observation &observation, BoardPose &outPose, int maxIterations) const
+  {
+    if (!observation.success)
+      return false;
+    const AprilTags::CameraModel &camera = _options.camera;
+    return estimatePose(observation.undistortedImagePoints, observation.cornerObserved, camera.fx, camera.fy,
+                        camera.cx, camera.cy, outPose, maxIterations);
+  }
+
+  bool AprilgridDetector::estimatePose(const Eigen::MatrixXd &imagePoints, const std::vector<bool> &cornerObserved,
+                                       double fx, double fy, double cx, double cy, BoardPose &outPose,
+                                       int maxIterations) const
+  {
+    // the homography is estimated on normalized image coordinates, where it is [r1 r2 t] up to scale;
+    // both point sets are centred and scaled to a mean distance of sqrt(2) (Hartley) for the DLT
+    size_t n = 0;
+    Eigen::Vector2d meanBoard(0, 0), meanImage(0, 0);
+    for (size_t i = 0; i < size(); i++)
+    {
+      if (!cornerObserved[i])
+        continue;
+      meanBoard += Eigen::Vector2d(_points(i, 0), _points(i, 1));
+      meanImage += Eigen::Vector2d((imagePoints(i, 0) - cx) / fx, (imagePoints(i, 1) - cy) / fy);
+      n++;
+    }
+    if (n < 4)
+      return false;
+    meanBoard /= (double)n;
+    meanImage /= (double)n;
+
+    double spreadBoard = 0, spreadImage = 0;
+    for (size_t i = 0; i < size(); i++)
+    {
+      if (!cornerObserved[i])
+        continue;
+      spreadBoard += (Eigen::Vector2d(_points(i, 0), _points(i, 1)) - meanBoard).norm();
+      spreadImage += (Eigen::Vector2d((imagePoints(i, 0) - cx) / fx, (imagePoints(i, 1) - cy) / fy) - meanImage).norm();
+    }
+    if (spreadBoard <= 0 || spreadImage <= 0)
+      return false;
+    const double scaleBoard = std::sqrt(2.0) * n / spreadBoard;
+    const double scaleImage = std::sqrt(2.0) * n / spreadImage;
+
+    // DLT: the homography is the eigenvector of A^T A with the smallest eigenvalue, A holding two rows per point
+    Eigen::Matrix<double, 9, 9> AtA = Eigen::Matrix<double, 9, 9>::Zero();
+    for (size_t i = 0; i < size(); i++)
+    {
+      if (!cornerObserved[i])
+        continue;
+      double X = scaleBoard * (_points(i, 0) - meanBoard(0));
+      double Y = scaleBoard * (_points(i, 1) - meanBoard(1));
+      double x = scaleImage * ((imagePoints(i, 0) - cx) / fx - meanImage(0));
+      double y = scaleImage * ((imagePoints(i, 1) - cy) / fy - meanImage(1));
+      Eigen::Matrix<double, 9, 1> a, b;
+      a << X, Y, 1, 0, 0, 0, -x * X, -x * Y, -x;
+      b << 0, 0, 0, X, Y, 1, -y * X, -y * Y, -y;
+      AtA.noalias() += a * a.transpose() + b * b.transpose();
+    }
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 9, 9>> eigen(AtA);
+    // a second (near) null vector: the corners lie on a line
+    if (eigen.info() != Eigen::Success || eigen.eigenvalues()(1) <= 1e-12 * eigen.eigenvalues()(8))
+      return false;
+    Eigen::Matrix3d Hn;
+    Hn << eigen.eigenvectors().col(0).segment<3>(0).transpose(),
+        eigen.eigenvectors().col(0).segment<3>(3).transpose(),
+        eigen.eigenvectors().col(0).segment<3>(6).transpose();
+
+    Eigen::Matrix3d denormalizeImage, normalizeBoard;
+    denormalizeImage << 1 / scaleImage, 0, meanImage(0),
+        0, 1 / scaleImage, meanImage(1),
+        0, 0, 1;
+    normalizeBoard << scaleBoard, 0, -scaleBoard * meanBoard(0),
+        0, scaleBoard, -scaleBoard * meanBoard(1),
+        0, 0, 1;
+    Eigen::Matrix3d H = denormalizeImage * Hn * normalizeBoard;
+
+    // closed-form pose: the first two columns are rotation axes, their mean length fixes the scale;
+    // the sign puts the board in front of the camera
+    double lambda = 2 / (H.col(0).norm() + H.col(1).norm());
+    if (H(2, 2) < 0)
+      lambda = -lambda;
+    Eigen::Matrix3d R;
+    R.col(0) = lambda * H.col(0);
+    R.col(1) = lambda * H.col(1);
+    R.col(2) = R.col(0).cross(R.col(1));
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(R, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    R = svd.matrixU() * svd.matrixV().transpose();
+    Eigen::Vector3d t = lambda * H.col(2);
+
+    // Gauss-Newton on the reprojection error; the rotation is updated by R <- exp([w]x) R
+    outPose.numIterations = 0;
+    double sum2 = 0;
+    for (int iteration = 0; iteration <= maxIterations; iteration++)
+    {
+      Eigen::Matrix<double, 6, 6> JtJ = Eigen::Matrix<double, 6, 6>::Zero();
+      Eigen::Matrix<double, 6, 1> Jtr = Eigen::Matrix<double, 6, 1>::Zero();
+      sum2 = 0;
+      for (size_t i = 0; i < size(); i++)
+      {
+        if (!cornerObserved[i])
+          continue;
+        Eigen::Vector3d RX = R * Eigen::Vector3d(_points(i, 0), _points(i, 1), _points(i, 2));
+        Eigen::Vector3d Xc = RX + t;
+        if (Xc(2) <= 0)
+          return false;
+        double iz = 1 / Xc(2);
+        Eigen::Vector2d r(imagePoints(i, 0) - (fx * Xc(0) * iz + cx), imagePoints(i, 1) - (fy * Xc(1) * iz + cy));
+        sum2 += r.squaredNorm();
+        if (iteration == maxIterations)
+          continue;
+
+        // rows of the Jacobian: with g the gradient of u (or v) by Xc, d/dt = g and
+        // d/dw = g^T d(exp([w]x) R X)/dw = g^T (-[R X]x) = (R X) x g
+        Eigen::Vector3d gu(fx * iz, 0, -fx * Xc(0) * iz * iz);
+        Eigen::Vector3d gv(0, fy * iz, -fy * Xc(1) * iz * iz);
+        Eigen::Matrix<double, 6, 1> ju, jv;
+        ju << RX.cross(gu), gu;
+        jv << RX.cross(gv), gv;
+        JtJ.noalias() += ju * ju.transpose() + jv * jv.transpose();
+        Jtr.noalias() += ju * r(0) + jv * r(1);
+      }
+      if (iteration == maxIterations)
+        break;
+
+      Eigen::LDLT<Eigen::Matrix<double, 6, 6>> ldlt(JtJ);
+      if (ldlt.info() != Eigen::Success)
+        return false;
+      Eigen::Matrix<double, 6, 1> delta = ldlt.solve(Jtr);
+      Eigen::Vector3d w = delta.head<3>();
+      double angle = w.norm();
+      if (angle > 0)
+        R = Eigen::AngleAxisd(angle, w / angle).toRotationMatrix() * R;
+      t += delta.tail<3>();
+      outPose.numIterations = iteration + 1;
+      // converged: one more pass for the final error
+      if (angle < 1e-10 && delta.tail<3>().norm() < 1e-10 * t.norm())
+        maxIterations = iteration + 1;
+    }
+
+    outPose.R = R;
+    outPose.t = t;
+    outPose.rmsError = std::sqrt(sum2 / n);
+    outPose.numPoints = n;
+    return true;
+  }
+
+  bool AprilgridDetector::observe(
+      const cv::Mat &image, double *outImagePoints, size_t rowStride, size_t colStride,
+      unsigned char *outCornerObserved, ObservationStatus &outStatus,
+      const AprilTags::TagDetector::TagCallback &onTag,
+      const AprilTags::TagDetector::Clock::time_point &deadline,
+      const std::vector<cv::Rect> *rois) const
+  {
+    outStatus = ObservationStatus();
 
     // detect the tags
     // AprilTags::TagDetector _tagDetector(_tagCodes, 2);
-    std::vector<AprilTags::TagDetection> detections = _tagDetector->extractTags(image);
+    std::vector<AprilTags::TagDetection> detections =
+        rois ? _tagDetector->extractTags(image, *rois, outStatus.extraction, deadline)
+             : _tagDetector->extractTags(image, outStatus.extraction, onTag, deadline);
+    return observeDetections(image, detections, outImagePoints, rowStride, colStride, outCornerObserved, outStatus);
+  }
+
+  bool AprilgridDetector::observeDetections(
+      const cv::Mat &image, std::vector<AprilTags::TagDetection> &detections,
+      double *outImagePoints, size_t rowStride, size_t colStride,
+      unsigned char *outCornerObserved, ObservationStatus &outStatus) const
+  {
+    bool success = true;
+    outStatus.numTagsDetected = detections.size();
 
     // min. distance [px] of tag corners from image border (tag is not used if violated)
     std::vector<AprilTags::TagDetection>::iterator iter = detections.begin();
     for (iter = detections.begin(); iter != detections.end();)
     {
       // check all four corners for violation
-      bool remove = false;
+      bool remove = nearBorder(*iter, image);
+      if (remove)
+        outStatus.numTagsNearBorder++;
 
-      for (int j = 0; j < 4; j++)
+      // also remove tags that are flagged as bad
+      else if (iter->good != 1)
       {
-        remove |= iter->p[j].first < _options.minBorderDistance;
-        remove |= iter->p[j].first > (float)(image.cols) - _options.minBorderDistance; // width
-        remove |= iter->p[j].second < _options.minBorderDistance;
-        remove |= iter->p[j].second > (float)(image.rows) - _options.minBorderDistance; // height
+        remove = true;
+        outStatus.numTagsBad++;
       }
 
-      // also remove tags that are flagged as bad
-      if (iter->good != 1)
-        remove |= true;
-
-      // also remove if the tag ID is out-of-range for this grid (faulty detection)
-      if (iter->id >= (int)size() / 4)
-        remove |= true;
+      // also remove if the tag ID is out-of-range for this grid (faulty detection, another board or family)
+      else if (iter->family != 0 || !onGrid(iter->id))
+      {
+        remove = true;
+        outStatus.numTagsOutOfRange++;
+      }
 
       // delete flagged tags
       if (remove)
@@ -179,20 +1098,37 @@ namespace calibration_toolkit
       }
     }
 
+    // sort detections by tagId
+    std::sort(detections.begin(), detections.end(),
+              AprilTags::TagDetection::sortByIdCompare);
+
+    // headless policies settle duplicates before counting the usable tags
+    if (_options.duplicateTagPolicy != DUPLICATES_SHOW_AND_EXIT &&
+        !resolveDuplicateTags(detections, outStatus))
+    {
+      outStatus.result = OBSERVATION_DUPLICATE_TAGS;
+      return false;
+    }
+
+    if (_options.recoverMissingTags)
+    {
+      recoverTags(image, detections, outStatus);
+      std::sort(detections.begin(), detections.end(),
+                AprilTags::TagDetection::sortByIdCompare);
+    }
+    outStatus.numTagsUsed = detections.size();
+
     // did we find enough tags?
     if (detections.size() < _options.minTagsForValidObs)
     {
       success = false;
+      outStatus.result = OBSERVATION_TOO_FEW_TAGS;
 
       if (!_options.showExtractionVideo)
         return success;
     }
 
-    // sort detections by tagId
-    std::sort(detections.begin(), detections.end(),
-              AprilTags::TagDetection::sortByIdCompare);
-
-    if (detections.size() > 1)
+    if (_options.duplicateTagPolicy == DUPLICATES_SHOW_AND_EXIT && detections.size() > 1)
     {
       for (unsigned i = 0; i < detections.size() - 1; i++)
         if (detections[i].id == detections[i + 1].id)
@@ -253,9 +1189,7 @@ namespace calibration_toolkit
     cv::Mat tagCornersRaw = tagCorners.clone();
 
     if (_options.doSubpixRefinement && success)
-      cv::cornerSubPix(
-          image, tagCorners, cv::Size(2, 2), cv::Size(-1, -1),
-          cv::TermCriteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, 30, 0.1));
+      refineCorners(image, tagCorners);
 
     if (_options.showExtractionVideo)
     {
@@ -302,17 +1236,13 @@ namespace calibration_toolkit
         return success;
     }
 
-    outCornerObserved.resize(size(), false);
-    outImagePoints.resize(size(), 2);
+    std::fill(outCornerObserved, outCornerObserved + size(), 0);
 
     for (unsigned int i = 0; i < detections.size(); i++)
     {
-      // get the tag id
-      unsigned int tagId = detections[i].id;
-
-      // calculate the grid idx for all four tag corners given the tagId and cols
-      unsigned int baseId = (int)(tagId / (_cols / 2)) * _cols * 2 + (tagId % (_cols / 2)) * 2;
-      unsigned int pIdx[] = {baseId, baseId + 1, baseId + (unsigned int)_cols + 1, baseId + (unsigned int)_cols};
+      // the grid idx for all four tag corners
+      size_t pIdx[4];
+      tagPointIndices(detections[i].id, pIdx);
 
       // add four points per tag
       for (int j = 0; j < 4; j++)
@@ -329,12 +1259,13 @@ namespace calibration_toolkit
         double subpix_displacement_squared = (corner_x - cornerRaw_x) * (corner_x - cornerRaw_x) + (corner_y - cornerRaw_y) * (corner_y - cornerRaw_y);
 
         // add all points, but only set active if the point has not moved to far in the subpix refinement
-        outImagePoints.row(pIdx[j]) = Eigen::Matrix<double, 1, 2>(corner_x,
-                                                                  corner_y);
+        outImagePoints[pIdx[j] * rowStride] = corner_x;
+        outImagePoints[pIdx[j] * rowStride + colStride] = corner_y;
 
         if (subpix_displacement_squared <= _options.maxSubpixDisplacement2)
         {
-          outCornerObserved[pIdx[j]] = true;
+          outCornerObserved[pIdx[j]] = 1;
+          outStatus.numCornersObserved++;
           // cv::putText(image, std::to_string(pIdx[j]),
           //             cv::Point(corner_x, corner_y), cv::FONT_HERSHEY_SIMPLEX, 0.5,
           //             CV_RGB(255, 0, 0), 2, 8, false);
@@ -342,7 +1273,8 @@ namespace calibration_toolkit
         else
         {
           // std::cout << "Subpix refinement failed for point: " << pIdx[j] << " with displacement: " << sqrt(subpix_displacement_squared) << "(point removed) \n";
-          outCornerObserved[pIdx[j]] = false;
+          outCornerObserved[pIdx[j]] = 0;
+          outStatus.numCornersSubpixRejected++;
         }
       }
     }
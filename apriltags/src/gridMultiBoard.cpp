@@ -0,0 +1,45 @@
+#include "apriltags/ThreadPool.h"
+#include "apriltags/gridMultiBoard.hpp"
+
+namespace calibration_toolkit
+{
+
+  AprilgridMultiBoardDetector::AprilgridMultiBoardDetector(const AprilgridDetector::AprilgridOptions &options)
+      : _options(options), _detectors()
+  {
+    // the boards refine their corners on one pool
+    if (!_options.threadPool)
+      _options.threadPool = std::make_shared<AprilTags::ThreadPool>(_options.numThreads);
+  }
+
+  size_t AprilgridMultiBoardDetector::addBoard(const BoardDefinition &board)
+  {
+    _detectors.push_back(AprilgridDetector(board.tagRows, board.tagCols, board.tagSize, board.tagSpacing,
+                                           board.idOffset, _options));
+    return _detectors.size() - 1;
+  }
+
+  size_t AprilgridMultiBoardDetector::computeObservations(
+      const cv::Mat &image, std::vector<AprilgridDetector::Observation> &outObservations,
+      const AprilTags::TagDetector::Clock::time_point &deadline) const
+  {
+    outObservations.resize(_detectors.size());
+    if (_detectors.empty())
+      return 0;
+
+    // one extraction for all boards; each board picks its ids from it
+    AprilTags::TagDetector::ExtractionStatus extraction;
+    std::vector<AprilTags::TagDetection> detections =
+        _detectors[0].tagDetector().extractTags(image, extraction, deadline);
+
+    size_t numSuccessful = 0;
+    for (size_t b = 0; b < _detectors.size(); b++)
+    {
+      if (_detectors[b].computeObservation(image, detections, outObservations[b]))
+        numSuccessful++;
+      outObservations[b].status.extraction = extraction;
+    }
+    return numSuccessful;
+  }
+
+} // namespace calibration_toolkit
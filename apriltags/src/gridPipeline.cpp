@@ -0,0 +1,182 @@
+#include <algorithm>
+
+#include "apriltags/gridPipeline.hpp"
+
+namespace calibration_toolkit
+{
+
+  AprilgridPipeline::AprilgridPipeline(const AprilgridDetector &detector, const PipelineOptions &options)
+      : _detector(detector), _options(options), _nextFrameId(0), _nextResultId(0),
+        _closed(false), _totalLatencySeconds(0)
+  {
+    unsigned int numWorkers = std::max(1u, _options.numWorkers);
+    for (unsigned int i = 0; i < numWorkers; i++)
+      _workers.push_back(std::thread(&AprilgridPipeline::workerLoop, this));
+  }
+
+  AprilgridPipeline::~AprilgridPipeline()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+      while (!_queue.empty())
+      {
+        dropFrame(_queue.front());
+        _queue.pop_front();
+      }
+    }
+    _frameQueued.notify_all();
+    _frameTaken.notify_all();
+    _resultReady.notify_all();
+    for (size_t i = 0; i < _workers.size(); i++)
+      _workers[i].join();
+  }
+
+  bool AprilgridPipeline::push(const cv::Mat &image)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    size_t queueSize = std::max<size_t>(1, _options.queueSize);
+
+    switch (_options.backpressurePolicy)
+    {
+    case BACKPRESSURE_BLOCK:
+      while (!_closed && _queue.size() >= queueSize)
+        _frameTaken.wait(lock);
+      break;
+    case BACKPRESSURE_DROP_OLDEST:
+      while (_queue.size() >= queueSize)
+      {
+        dropFrame(_queue.front());
+        _queue.pop_front();
+      }
+      break;
+    case BACKPRESSURE_KEEP_LATEST:
+      while (!_queue.empty())
+      {
+        dropFrame(_queue.front());
+        _queue.pop_front();
+      }
+      break;
+    }
+    if (_closed)
+      return false;
+
+    Frame frame;
+    frame.id = _nextFrameId++;
+    frame.image = image;
+    frame.pushTime = Clock::now();
+    frame.queueDepth = _queue.size();
+    _queue.push_back(frame);
+
+    _statistics.framesPushed++;
+    _statistics.maxQueueDepth = std::max(_statistics.maxQueueDepth, _queue.size());
+    lock.unlock();
+    _frameQueued.notify_one();
+    return true;
+  }
+
+  void AprilgridPipeline::close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+    }
+    _frameQueued.notify_all();
+    _frameTaken.notify_all();
+    _resultReady.notify_all();
+  }
+
+  void AprilgridPipeline::dropFrame(const Frame &frame)
+  {
+    _dropped.insert(frame.id);
+    _statistics.framesDropped++;
+    _resultReady.notify_all();
+  }
+
+  bool AprilgridPipeline::takeNext(Result &result)
+  {
+    // pass the dropped frames in front of the next result
+    std::set<uint64_t>::iterator dropped;
+    while ((dropped = _dropped.find(_nextResultId)) != _dropped.end())
+    {
+      _dropped.erase(dropped);
+      _nextResultId++;
+    }
+
+    std::map<uint64_t, Result>::iterator it = _completed.find(_nextResultId);
+    if (it == _completed.end())
+      return false;
+
+    std::swap(result, it->second);
+    _completed.erase(it);
+    _nextResultId++;
+    return true;
+  }
+
+  bool AprilgridPipeline::pop(Result &result)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+      if (takeNext(result))
+        return true;
+      if (_closed && _nextResultId == _nextFrameId)
+        return false;
+      _resultReady.wait(lock);
+    }
+  }
+
+  bool AprilgridPipeline::tryPop(Result &result)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return takeNext(result);
+  }
+
+  AprilgridPipeline::Statistics AprilgridPipeline::statistics() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    Statistics statistics = _statistics;
+    statistics.queueDepth = _queue.size();
+    return statistics;
+  }
+
+  void AprilgridPipeline::workerLoop()
+  {
+    while (true)
+    {
+      Frame frame;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_queue.empty() && !_closed)
+          _frameQueued.wait(lock);
+        if (_queue.empty())
+          return;
+
+        frame = _queue.front();
+        _queue.pop_front();
+        _statistics.framesInProgress++;
+      }
+      _frameTaken.notify_one();
+
+      Result result;
+      result.frameId = frame.id;
+      result.queueDepth = frame.queueDepth;
+      result.queueSeconds = std::chrono::duration<double>(Clock::now() - frame.pushTime).count();
+      _detector.computeObservation(frame.image, result.observation);
+      result.latencySeconds = std::chrono::duration<double>(Clock::now() - frame.pushTime).count();
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _statistics.framesInProgress--;
+        _statistics.framesCompleted++;
+        _totalLatencySeconds += result.latencySeconds;
+        _statistics.lastLatencySeconds = result.latencySeconds;
+        _statistics.meanLatencySeconds = _totalLatencySeconds / _statistics.framesCompleted;
+        _statistics.maxLatencySeconds = std::max(_statistics.maxLatencySeconds, result.latencySeconds);
+        std::swap(_completed[result.frameId], result);
+      }
+      _resultReady.notify_all();
+    }
+  }
+
+} // namespace calibration_toolkit
@@ -0,0 +1,67 @@
+#include <algorithm>
+
+#include "apriltags/ThreadPool.h"
+#include "apriltags/gridRig.hpp"
+
+namespace calibration_toolkit
+{
+
+  namespace
+  {
+    //! orders camera indices by decreasing image size
+    struct LargerImage
+    {
+      explicit LargerImage(const std::vector<cv::Mat> &images) : images(images) {}
+      bool operator()(size_t a, size_t b) const
+      {
+        return (size_t)images[a].rows * images[a].cols > (size_t)images[b].rows * images[b].cols;
+      }
+      const std::vector<cv::Mat> &images;
+    };
+  }
+
+  AprilgridRigDetector::AprilgridRigDetector(unsigned int numThreads)
+      : _threadPool(std::make_shared<AprilTags::ThreadPool>(numThreads)), _detectors() {}
+
+  size_t AprilgridRigDetector::addCamera(double tagSize, double tagSpacing,
+                                         const AprilgridDetector::AprilgridOptions &options)
+  {
+    AprilgridDetector::AprilgridOptions cameraOptions = options;
+    cameraOptions.threadPool = _threadPool;
+    _detectors.push_back(AprilgridDetector(tagSize, tagSpacing, cameraOptions));
+    return _detectors.size() - 1;
+  }
+
+  size_t AprilgridRigDetector::computeObservations(
+      const std::vector<cv::Mat> &images, std::vector<AprilgridDetector::Observation> &outObservations,
+      const AprilTags::TagDetector::Clock::time_point &deadline) const
+  {
+    size_t numCameras = std::min(images.size(), _detectors.size());
+    outObservations.resize(_detectors.size());
+
+    // start the largest images first (chunks are handed out in order), so that the
+    // slowest camera does not begin last and the others can help it when they are done
+    std::vector<size_t> order(numCameras);
+    for (size_t i = 0; i < numCameras; i++)
+      order[i] = i;
+    std::stable_sort(order.begin(), order.end(), LargerImage(images));
+
+    _threadPool->parallelFor((int)numCameras, 1, [&](int begin, int end) {
+      for (int k = begin; k < end; k++)
+      {
+        size_t camera = order[k];
+        _detectors[camera].computeObservation(images[camera], outObservations[camera], deadline);
+      }
+    });
+
+    size_t numSuccessful = 0;
+    for (size_t i = 0; i < numCameras; i++)
+      if (outObservations[i].success)
+        numSuccessful++;
+    // cameras without an image
+    for (size_t i = numCameras; i < outObservations.size(); i++)
+      outObservations[i] = AprilgridDetector::Observation();
+    return numSuccessful;
+  }
+
+} // namespace calibration_toolkit